@@ -0,0 +1,170 @@
+#ifndef EM5820_BARCODE_HPP
+#define EM5820_BARCODE_HPP
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace em5820 {
+
+// 1D symbologies of GS k, function B (m = 65 + index)
+enum class Barcode {
+  UPC_A,
+  UPC_E,
+  EAN13,
+  EAN8,
+  CODE39,
+  ITF,
+  CODABAR,
+  CODE93,
+  CODE128
+};
+
+// Where GS H prints the human readable interpretation
+enum class HriPosition { NONE, ABOVE, BELOW, BOTH };
+
+struct BarcodeStyle {
+  uint8_t module_width = 3; // GS w, narrowest bar in dots (2-6)
+  uint8_t height = 80;      // GS h, in dots
+  HriPosition hri = HriPosition::BELOW;
+};
+
+enum class QrErrorCorrection { L, M, Q, H };
+
+struct QrStyle {
+  uint8_t module_size = 4; // dots per module (1-16)
+  QrErrorCorrection error_correction = QrErrorCorrection::M;
+};
+
+struct Pdf417Style {
+  uint8_t columns = 0;          // data columns, 0 = automatic
+  uint8_t rows = 0;             // 0 = automatic
+  uint8_t module_width = 3;     // dots (2-8)
+  uint8_t row_height = 3;       // times the module width (2-8)
+  uint8_t error_correction = 1; // level 0-8
+};
+
+inline Barcode barcode_from_name(const std::string &name) {
+  static const char *const names[]{"upc-a", "upc-e",   "ean13",
+                                   "ean8",  "code39",  "itf",
+                                   "codabar", "code93", "code128"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    if (name == names[i])
+      return static_cast<Barcode>(i);
+  throw std::runtime_error("Unknown barcode type: " + name);
+}
+
+// GS w, GS h and GS H followed by GS k. CODE128 data without a leading
+// code set selector is sent as code set B, with '{' escaped.
+inline void encode_barcode(Barcode type, const std::string &data,
+                           const BarcodeStyle &style,
+                           std::vector<uint8_t> &out) {
+  std::string payload = data;
+  if (type == Barcode::CODE128 && (data.empty() || data[0] != '{')) {
+    payload = "{B";
+    for (char c : data) {
+      payload += c;
+      if (c == '{')
+        payload += c;
+    }
+  }
+
+  if (data.empty() || payload.size() > 255)
+    throw std::runtime_error("Barcode data must be 1 to 255 bytes");
+  if (style.module_width < 2 || style.module_width > 6)
+    throw std::runtime_error("Barcode module width must be 2 to 6 dots");
+  if (style.height == 0)
+    throw std::runtime_error("Barcode height must be positive");
+
+  const uint8_t setup[11]{0x1d,
+                          0x77,
+                          style.module_width,
+                          0x1d,
+                          0x68,
+                          style.height,
+                          0x1d,
+                          0x48,
+                          static_cast<uint8_t>(style.hri),
+                          0x1d,
+                          0x6b};
+  out.insert(out.end(), setup, setup + sizeof(setup));
+  out.push_back(static_cast<uint8_t>(65 + static_cast<int>(type)));
+  out.push_back(static_cast<uint8_t>(payload.size()));
+  out.insert(out.end(), payload.begin(), payload.end());
+}
+
+// GS ( k: pL pH cn fn, then the parameters of the function
+inline void append_gs_k(uint8_t cn, uint8_t fn, const uint8_t *params,
+                        size_t count, std::vector<uint8_t> &out) {
+  size_t p = count + 2;
+  if (p > 0xffff)
+    throw std::runtime_error("GS ( k data longer than 65533 bytes");
+  const uint8_t header[7]{0x1d, 0x28, 0x6b, static_cast<uint8_t>(p & 0xff),
+                          static_cast<uint8_t>((p >> 8) & 0xff), cn, fn};
+  out.insert(out.end(), header, header + sizeof(header));
+  out.insert(out.end(), params, params + count);
+}
+
+// Store the symbol data (fn 80, m = 48), then print it (fn 81)
+inline void append_gs_k_symbol(uint8_t cn, const std::string &data,
+                               std::vector<uint8_t> &out) {
+  if (data.empty())
+    throw std::runtime_error("Symbol data must not be empty");
+  std::vector<uint8_t> stored;
+  stored.reserve(data.size() + 1);
+  stored.push_back(0x30);
+  stored.insert(stored.end(), data.begin(), data.end());
+  append_gs_k(cn, 0x50, stored.data(), stored.size(), out);
+
+  const uint8_t print[1]{0x30};
+  append_gs_k(cn, 0x51, print, sizeof(print), out);
+}
+
+// QR code, model 2 (cn = 49)
+inline void encode_qr(const std::string &data, const QrStyle &style,
+                      std::vector<uint8_t> &out) {
+  if (style.module_size < 1 || style.module_size > 16)
+    throw std::runtime_error("QR module size must be 1 to 16 dots");
+
+  const uint8_t model[2]{0x32, 0x00};
+  const uint8_t size[1]{style.module_size};
+  const uint8_t level[1]{
+      static_cast<uint8_t>(0x30 + static_cast<int>(style.error_correction))};
+  append_gs_k(0x31, 0x41, model, sizeof(model), out);
+  append_gs_k(0x31, 0x43, size, sizeof(size), out);
+  append_gs_k(0x31, 0x45, level, sizeof(level), out);
+  append_gs_k_symbol(0x31, data, out);
+}
+
+// PDF417 (cn = 48)
+inline void encode_pdf417(const std::string &data, const Pdf417Style &style,
+                          std::vector<uint8_t> &out) {
+  if (style.columns > 30 || (style.rows != 0 && style.rows < 3) ||
+      style.rows > 90)
+    throw std::runtime_error("PDF417 takes up to 30 columns and 3 to 90 rows");
+  if (style.module_width < 2 || style.module_width > 8 ||
+      style.row_height < 2 || style.row_height > 8)
+    throw std::runtime_error("PDF417 module width and row height are 2 to 8");
+  if (style.error_correction > 8)
+    throw std::runtime_error("PDF417 error correction level is 0 to 8");
+
+  const uint8_t columns[1]{style.columns};
+  const uint8_t rows[1]{style.rows};
+  const uint8_t width[1]{style.module_width};
+  const uint8_t height[1]{style.row_height};
+  const uint8_t level[2]{0x30,
+                         static_cast<uint8_t>(0x30 + style.error_correction)};
+  const uint8_t standard[1]{0x00};
+  append_gs_k(0x30, 0x41, columns, sizeof(columns), out);
+  append_gs_k(0x30, 0x42, rows, sizeof(rows), out);
+  append_gs_k(0x30, 0x43, width, sizeof(width), out);
+  append_gs_k(0x30, 0x44, height, sizeof(height), out);
+  append_gs_k(0x30, 0x45, level, sizeof(level), out);
+  append_gs_k(0x30, 0x46, standard, sizeof(standard), out);
+  append_gs_k_symbol(0x30, data, out);
+}
+
+} // namespace em5820
+
+#endif // EM5820_BARCODE_HPP
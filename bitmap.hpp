@@ -0,0 +1,390 @@
+#ifndef EM5820_BITMAP_HPP
+#define EM5820_BITMAP_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace em5820 {
+
+// Non-owning view of a packed 1-bit raster (1 = black, MSB = leftmost dot).
+// Rows are stride bytes apart, so row ranges and byte-aligned column ranges
+// of a larger bitmap are views too and cost nothing to make.
+template <typename T> struct BasicBitmapView {
+  T *data = nullptr;
+  uint16_t width = 0;  // dots, multiple of 8
+  uint32_t height = 0; // rows
+  size_t stride = 0;   // bytes from one row to the next
+
+  BasicBitmapView() = default;
+
+  BasicBitmapView(T *data, uint16_t width, uint32_t height, size_t stride)
+      : data(data), width(width), height(height), stride(stride) {}
+
+  BasicBitmapView(T *data, uint16_t width, uint32_t height)
+      : BasicBitmapView(data, width, height, width / 8) {}
+
+  // A mutable view converts to a read-only one
+  template <typename U>
+  BasicBitmapView(const BasicBitmapView<U> &other)
+      : data(other.data), width(other.width), height(other.height),
+        stride(other.stride) {}
+
+  size_t bytes_per_line() const { return width / 8; }
+
+  // Rows are back to back, so the pixels form one span
+  bool contiguous() const { return stride == bytes_per_line(); }
+
+  T *row(uint32_t y) const { return data + y * stride; }
+
+  BasicBitmapView rows(uint32_t first, uint32_t count) const {
+    if (first + count > height)
+      throw std::runtime_error("Row range outside bitmap");
+    return BasicBitmapView(row(first), width, count, stride);
+  }
+
+  BasicBitmapView columns(size_t first_byte, size_t bytes) const {
+    if (first_byte + bytes > bytes_per_line())
+      throw std::runtime_error("Column range outside bitmap");
+    return BasicBitmapView(data + first_byte, static_cast<uint16_t>(bytes * 8),
+                           height, stride);
+  }
+};
+
+using Bitmap1View = BasicBitmapView<uint8_t>;
+using ConstBitmap1View = BasicBitmapView<const uint8_t>;
+
+// Owning packed 1-bit raster. Move-only, so passing one along never copies
+// the pixels by accident; use views to hand out parts of it.
+class Bitmap1 {
+public:
+  Bitmap1() = default;
+
+  // White bitmap
+  Bitmap1(uint16_t width, uint32_t height)
+      : bits(width / 8 * static_cast<size_t>(height), 0), width(width),
+        height(height) {
+    if (width % 8 != 0)
+      throw std::runtime_error("Width must be multiple of 8");
+  }
+
+  // Adopt rows packed back to back
+  Bitmap1(uint16_t width, uint32_t height, std::vector<uint8_t> &&packed)
+      : bits(std::move(packed)), width(width), height(height) {
+    if (width % 8 != 0)
+      throw std::runtime_error("Width must be multiple of 8");
+    if (bits.size() < width / 8 * static_cast<size_t>(height))
+      throw std::runtime_error("Bitmap is smaller than width x height");
+  }
+
+  Bitmap1(Bitmap1 &&) = default;
+  Bitmap1 &operator=(Bitmap1 &&) = default;
+  Bitmap1(const Bitmap1 &) = delete;
+  Bitmap1 &operator=(const Bitmap1 &) = delete;
+
+  uint16_t get_width() const { return width; }
+  uint32_t get_height() const { return height; }
+  size_t size() const { return bits.size(); }
+
+  uint8_t *data() { return bits.data(); }
+  const uint8_t *data() const { return bits.data(); }
+
+  Bitmap1View view() { return Bitmap1View(bits.data(), width, height); }
+  ConstBitmap1View view() const {
+    return ConstBitmap1View(bits.data(), width, height);
+  }
+
+  // Give up the pixels, leaving an empty bitmap
+  std::vector<uint8_t> release() {
+    std::vector<uint8_t> packed;
+    packed.swap(bits);
+    width = 0;
+    height = 0;
+    return packed;
+  }
+
+private:
+  std::vector<uint8_t> bits;
+  uint16_t width = 0;
+  uint32_t height = 0;
+};
+
+// Number of black dots (set bits) in a packed raster span. Works a 64-bit
+// word at a time so the compiler can emit POPCNT or a vector popcount.
+inline uint64_t count_black_dots(const uint8_t *data, size_t size) {
+  uint64_t dots = 0;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    dots += __builtin_popcountll(word);
+  }
+  for (; i < size; ++i)
+    dots += __builtin_popcount(data[i]);
+  return dots;
+}
+
+inline uint64_t count_black_dots(ConstBitmap1View bitmap) {
+  if (bitmap.contiguous())
+    return count_black_dots(bitmap.data,
+                            bitmap.bytes_per_line() * bitmap.height);
+
+  uint64_t dots = 0;
+  for (uint32_t y = 0; y < bitmap.height; ++y)
+    dots += count_black_dots(bitmap.row(y), bitmap.bytes_per_line());
+  return dots;
+}
+
+// Copy src into the top-left corner of dst, row by row
+inline void copy(ConstBitmap1View src, Bitmap1View dst) {
+  if (src.width > dst.width || src.height > dst.height)
+    throw std::runtime_error("Source bitmap larger than destination");
+  for (uint32_t y = 0; y < src.height; ++y)
+    std::memcpy(dst.row(y), src.row(y), src.bytes_per_line());
+}
+
+// How blit() combines source bits with the destination
+enum class BlitOp { OR, AND, XOR };
+
+namespace detail {
+
+// Packed rows are big-endian bit strings: the leftmost dot is the MSB of
+// the first byte. Words are loaded that way so shifts move dots sideways.
+inline uint64_t load_be64(const uint8_t *p) {
+  uint64_t word;
+  std::memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+inline void store_be64(uint8_t *p, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  std::memcpy(p, &word, sizeof(word));
+}
+
+template <typename T> inline T apply(BlitOp op, T dst, T src) {
+  switch (op) {
+  case BlitOp::AND:
+    return dst & src;
+  case BlitOp::XOR:
+    return dst ^ src;
+  case BlitOp::OR:
+  default:
+    return dst | src;
+  }
+}
+
+// Combine n dots of src starting at dot sx into dst starting at dot dx.
+// The edge bytes of dst are masked; everything between goes 8 bytes at a
+// time, shifting the source by the bit offset between the two rows.
+inline void blit_row(const uint8_t *src, size_t sx, uint8_t *dst, size_t dx,
+                     size_t n, BlitOp op) {
+  if (n == 0)
+    return;
+
+  size_t first = dx / 8, last = (dx + n - 1) / 8;
+  size_t src_first = sx / 8, src_last = (sx + n - 1) / 8;
+
+  // The source dot that lands on dot 8 * j of dst, split into byte and bit
+  auto source_of = [&](size_t j, size_t &byte, unsigned &bit) {
+    int64_t b = static_cast<int64_t>(sx + 8 * j) - static_cast<int64_t>(dx);
+    int64_t i = b >= 0 ? b / 8 : (b - 7) / 8;
+    bit = static_cast<unsigned>(b - 8 * i);
+    byte = static_cast<size_t>(i);
+  };
+
+  auto fetch = [&](size_t j) -> uint8_t {
+    size_t i;
+    unsigned r;
+    source_of(j, i, r);
+    // i may have wrapped below src_first for the first byte
+    unsigned v = 0;
+    if (i >= src_first && i <= src_last)
+      v |= src[i] << r;
+    if (r != 0 && i + 1 >= src_first && i + 1 <= src_last)
+      v |= src[i + 1] >> (8 - r);
+    return static_cast<uint8_t>(v);
+  };
+
+  auto put = [&](size_t j, uint8_t mask) {
+    uint8_t v = apply<uint8_t>(op, dst[j], fetch(j));
+    dst[j] = static_cast<uint8_t>((dst[j] & ~mask) | (v & mask));
+  };
+
+  uint8_t head = static_cast<uint8_t>(0xff >> (dx % 8));
+  uint8_t tail = static_cast<uint8_t>(0xff << (7 - (dx + n - 1) % 8));
+  if (first == last) {
+    put(first, head & tail);
+    return;
+  }
+
+  put(first, head);
+  size_t j = first + 1;
+  size_t i;
+  unsigned r;
+  source_of(j, i, r);
+
+  if (r == 0) {
+    // Byte-aligned: plain word ops, no shifting
+    for (; j + 8 <= last && i + 7 <= src_last; j += 8, i += 8) {
+      uint64_t d, w;
+      std::memcpy(&d, dst + j, sizeof(d));
+      std::memcpy(&w, src + i, sizeof(w));
+      d = apply(op, d, w);
+      std::memcpy(dst + j, &d, sizeof(d));
+    }
+  } else {
+    for (; j + 8 <= last && i + 8 <= src_last; j += 8, i += 8) {
+      uint64_t w = load_be64(src + i) << r | src[i + 8] >> (8 - r);
+      store_be64(dst + j, apply(op, load_be64(dst + j), w));
+    }
+  }
+
+  for (; j < last; ++j)
+    put(j, 0xff);
+  put(last, tail);
+}
+
+} // namespace detail
+
+// Combine src into dst with its top-left corner at dot (x, y). x needs no
+// byte alignment; whatever falls outside dst is clipped.
+inline void blit(ConstBitmap1View src, Bitmap1View dst, int x, int y,
+                 BlitOp op = BlitOp::OR) {
+  int64_t sx = x < 0 ? -static_cast<int64_t>(x) : 0;
+  int64_t sy = y < 0 ? -static_cast<int64_t>(y) : 0;
+  int64_t dx = x < 0 ? 0 : x;
+  int64_t dy = y < 0 ? 0 : y;
+  int64_t n = std::min<int64_t>(src.width - sx, dst.width - dx);
+  int64_t rows = std::min<int64_t>(src.height - sy, dst.height - dy);
+  if (n <= 0 || rows <= 0)
+    return;
+
+  for (int64_t r = 0; r < rows; ++r)
+    detail::blit_row(src.row(static_cast<uint32_t>(sy + r)),
+                     static_cast<size_t>(sx),
+                     dst.row(static_cast<uint32_t>(dy + r)),
+                     static_cast<size_t>(dx), static_cast<size_t>(n), op);
+}
+
+// Swap black and white
+inline void invert(Bitmap1View bitmap) {
+  size_t bytes = bitmap.bytes_per_line();
+  uint32_t rows = bitmap.height;
+  if (bitmap.contiguous()) {
+    bytes *= rows;
+    rows = rows > 0 ? 1 : 0;
+  }
+
+  for (uint32_t y = 0; y < rows; ++y) {
+    uint8_t *p = bitmap.row(y);
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+      uint64_t word;
+      std::memcpy(&word, p + i, sizeof(word));
+      word = ~word;
+      std::memcpy(p + i, &word, sizeof(word));
+    }
+    for (; i < bytes; ++i)
+      p[i] = static_cast<uint8_t>(~p[i]);
+  }
+}
+
+namespace detail {
+
+// Each byte with its bits in reverse order
+inline const uint8_t *reversed_bits() {
+  static const struct Table {
+    uint8_t value[256];
+    Table() {
+      for (int i = 0; i < 256; ++i) {
+        uint8_t r = 0;
+        for (int b = 0; b < 8; ++b)
+          if (i & (1 << b))
+            r |= static_cast<uint8_t>(0x80 >> b);
+        value[i] = r;
+      }
+    }
+  } table;
+  return table.value;
+}
+
+// Each byte with every bit doubled, as a big-endian pair of bytes
+inline const uint16_t *doubled_bits() {
+  static const struct Table {
+    uint16_t value[256];
+    Table() {
+      for (int i = 0; i < 256; ++i) {
+        uint16_t d = 0;
+        for (int b = 0; b < 8; ++b)
+          if (i & (1 << b))
+            d |= static_cast<uint16_t>(3 << (2 * b));
+        value[i] = d;
+      }
+    }
+  } table;
+  return table.value;
+}
+
+} // namespace detail
+
+// Mirror left to right in place: reverse the bytes of each row and the bits
+// of each byte through a lookup table
+inline void mirror(Bitmap1View bitmap) {
+  const uint8_t *reverse = detail::reversed_bits();
+  size_t bytes = bitmap.bytes_per_line();
+
+  for (uint32_t y = 0; y < bitmap.height; ++y) {
+    uint8_t *p = bitmap.row(y);
+    for (size_t i = 0, k = bytes; i < k--; ++i) {
+      uint8_t left = reverse[p[i]];
+      p[i] = reverse[p[k]];
+      p[k] = left;
+    }
+  }
+}
+
+// Turn upside down in place: mirror every row and swap the row order
+inline void rotate180(Bitmap1View bitmap) {
+  mirror(bitmap);
+  size_t bytes = bitmap.bytes_per_line();
+  for (uint32_t top = 0, bottom = bitmap.height; top + 1 < bottom;
+       ++top, --bottom)
+    std::swap_ranges(bitmap.row(top), bitmap.row(top) + bytes,
+                     bitmap.row(bottom - 1));
+}
+
+// Double the size: every dot becomes a 2x2 block
+inline Bitmap1 scale2x(ConstBitmap1View src) {
+  if (src.width > 0xffff / 2)
+    throw std::runtime_error("Bitmap too wide to scale 2x");
+
+  const uint16_t *doubled = detail::doubled_bits();
+  Bitmap1 out(static_cast<uint16_t>(src.width * 2), src.height * 2);
+  Bitmap1View dst = out.view();
+  size_t bytes = src.bytes_per_line();
+
+  for (uint32_t y = 0; y < src.height; ++y) {
+    const uint8_t *in = src.row(y);
+    uint8_t *top = dst.row(2 * y);
+    for (size_t i = 0; i < bytes; ++i) {
+      uint16_t d = doubled[in[i]];
+      top[2 * i] = static_cast<uint8_t>(d >> 8);
+      top[2 * i + 1] = static_cast<uint8_t>(d & 0xff);
+    }
+    std::memcpy(dst.row(2 * y + 1), top, dst.bytes_per_line());
+  }
+
+  return out;
+}
+
+} // namespace em5820
+
+#endif // EM5820_BITMAP_HPP
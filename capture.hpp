@@ -0,0 +1,240 @@
+#ifndef EM5820_CAPTURE_HPP
+#define EM5820_CAPTURE_HPP
+
+#include "transport.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h> // for usleep
+
+namespace em5820 {
+
+// Capture file: the magic "EM58CAP1", then one record per transfer:
+//   direction   1 byte, 'O' host to printer, 'I' printer to host
+//   delay       varint, microseconds since the previous record
+//   length      varint
+//   data        length bytes
+// Varints are little-endian base 128, so a typical record costs 3 bytes
+// on top of its data.
+struct CaptureRecord {
+  enum Direction : uint8_t { OUT = 'O', IN = 'I' };
+  Direction direction = OUT;
+  uint64_t time_us = 0; // since the start of the capture
+  std::vector<uint8_t> data;
+};
+
+namespace detail {
+
+static const char CAPTURE_MAGIC[8]{'E', 'M', '5', '8', 'C', 'A', 'P', '1'};
+
+inline void put_varint(std::ostream &out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    out.put(static_cast<char>(value ? byte | 0x80 : byte));
+  } while (value);
+}
+
+inline bool get_varint(std::istream &in, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = in.get();
+    if (c == EOF)
+      return false;
+    value |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+} // namespace detail
+
+class CaptureWriter {
+public:
+  explicit CaptureWriter(std::ostream &out)
+      : out(out), start(std::chrono::steady_clock::now()) {
+    out.write(detail::CAPTURE_MAGIC, sizeof(detail::CAPTURE_MAGIC));
+  }
+
+  // Microseconds since the capture started, to stamp a record with
+  uint64_t now_us() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  void write(CaptureRecord::Direction direction, const uint8_t *data,
+             size_t size) {
+    write(direction, data, size, now_us());
+  }
+
+  // Record a transfer at time_us; records must come in time order
+  void write(CaptureRecord::Direction direction, const uint8_t *data,
+             size_t size, uint64_t time_us) {
+    out.put(static_cast<char>(direction));
+    detail::put_varint(out, time_us - last_us);
+    detail::put_varint(out, size);
+    out.write(reinterpret_cast<const char *>(data), size);
+    if (!out)
+      throw std::runtime_error("Failed to write capture");
+    last_us = time_us;
+  }
+
+private:
+  std::ostream &out;
+  std::chrono::steady_clock::time_point start;
+  uint64_t last_us = 0;
+};
+
+class CaptureReader {
+public:
+  explicit CaptureReader(std::istream &in) : in(in) {
+    char magic[sizeof(detail::CAPTURE_MAGIC)];
+    if (!in.read(magic, sizeof(magic)) ||
+        !std::equal(magic, magic + sizeof(magic), detail::CAPTURE_MAGIC))
+      throw std::runtime_error("Not an EM5820 capture");
+  }
+
+  // The next record; false at the end of the capture
+  bool next(CaptureRecord &record) {
+    int direction = in.get();
+    if (direction == EOF)
+      return false;
+    uint64_t delay, size;
+    if ((direction != CaptureRecord::OUT && direction != CaptureRecord::IN) ||
+        !detail::get_varint(in, delay) || !detail::get_varint(in, size))
+      throw std::runtime_error("Corrupt capture record");
+
+    record.direction = static_cast<CaptureRecord::Direction>(direction);
+    record.time_us = time_us += delay;
+    record.data.resize(size);
+    if (!in.read(reinterpret_cast<char *>(record.data.data()), size))
+      throw std::runtime_error("Capture ends inside a record");
+    return true;
+  }
+
+private:
+  std::istream &in;
+  uint64_t time_us = 0;
+};
+
+// A tap on a transport: everything written and every reply read passes
+// through to the wrapped transport and into a capture file
+class RecordingTransport : public Transport {
+public:
+  RecordingTransport(Transport &inner, const std::string &filename)
+      : inner(inner), file(filename, std::ios::binary), capture(file) {
+    if (!file)
+      throw std::runtime_error("Cannot create capture: " + filename);
+  }
+
+  // Stamped with the start of the transfer, so a paced replay starts each
+  // one when the original started, however long it was held up
+  size_t write(const uint8_t *data, size_t size) override {
+    uint64_t started = capture.now_us();
+    size_t sent = inner.write(data, size);
+    capture.write(CaptureRecord::OUT, data, sent, started);
+    return sent;
+  }
+
+  size_t read(uint8_t *buffer, size_t size, unsigned timeout_ms) override {
+    size_t n = inner.read(buffer, size, timeout_ms);
+    if (n > 0)
+      capture.write(CaptureRecord::IN, buffer, n);
+    return n;
+  }
+
+  size_t max_packet_size() const override { return inner.max_packet_size(); }
+  std::string manufacturer() override { return inner.manufacturer(); }
+  std::string product() override { return inner.product(); }
+
+private:
+  Transport &inner;
+  std::ofstream file;
+  CaptureWriter capture;
+};
+
+// What a replay did, next to what the capture recorded
+struct ReplayStats {
+  size_t out_transfers = 0;
+  size_t out_bytes = 0;
+  size_t replies_expected = 0; // IN records in the capture
+  size_t replies_received = 0;
+  size_t replies_differing = 0; // received, but not the recorded bytes
+  double recorded_seconds = 0;
+  double seconds = 0;
+};
+
+// Send the OUT records of a capture again. Paced, each one goes out at its
+// recorded offset from the start; otherwise as fast as the transport takes
+// them. Each IN record waits for a reply of the same length, for up to its
+// recorded delay plus a second.
+inline ReplayStats replay_capture(std::istream &in, Transport &link,
+                                  bool paced) {
+  CaptureReader reader(in);
+  CaptureRecord record;
+  ReplayStats stats;
+  uint64_t previous_us = 0;
+  std::vector<uint8_t> reply;
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed_us = [&] {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+  };
+
+  while (reader.next(record)) {
+    if (record.direction == CaptureRecord::OUT) {
+      uint64_t now = elapsed_us();
+      if (paced && record.time_us > now)
+        usleep(static_cast<useconds_t>(record.time_us - now));
+      link.write(record.data.data(), record.data.size());
+      ++stats.out_transfers;
+      stats.out_bytes += record.data.size();
+    } else {
+      ++stats.replies_expected;
+      uint64_t wait_ms = std::min<uint64_t>(
+          30000, (record.time_us - previous_us) / 1000 + 1000);
+      auto deadline = std::chrono::steady_clock::now() +
+                      std::chrono::milliseconds(wait_ms);
+
+      reply.resize(record.data.size());
+      size_t got = 0;
+      while (got < reply.size()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now())
+                        .count();
+        if (left <= 0)
+          break;
+        size_t n = link.read(reply.data() + got, reply.size() - got,
+                             static_cast<unsigned>(left));
+        if (n == 0)
+          break;
+        got += n;
+      }
+      if (got > 0) {
+        ++stats.replies_received;
+        if (got != reply.size() ||
+            !std::equal(reply.begin(), reply.end(), record.data.begin()))
+          ++stats.replies_differing;
+      }
+    }
+    previous_us = record.time_us;
+  }
+
+  stats.recorded_seconds = previous_us / 1e6;
+  stats.seconds = elapsed_us() / 1e6;
+  return stats;
+}
+
+} // namespace em5820
+
+#endif // EM5820_CAPTURE_HPP
@@ -0,0 +1,129 @@
+#ifndef EM5820_COMMANDS_HPP
+#define EM5820_COMMANDS_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace em5820 {
+
+// Compile-time integer sequences (std::index_sequence is C++14)
+template <size_t... I> struct IndexSequence {};
+
+template <size_t N, size_t... I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t... I> struct MakeIndexSequence<0, I...> : IndexSequence<I...> {};
+
+// A fixed ESC/POS byte sequence. A literal type, so commands with constant
+// parameters, and any concatenation of them, are built by the compiler:
+//
+//   constexpr auto prologue = cmd::reset() + cmd::align(1) + cmd::bold(true);
+//   printer.write_bytes(prologue);
+//
+// sends three commands in one transfer without building anything at run
+// time. std::array has no constexpr element access before C++14, hence the
+// own type; to_array() converts.
+template <size_t N> struct Command {
+  uint8_t bytes[N];
+
+  static constexpr size_t size() { return N; }
+  constexpr uint8_t operator[](size_t i) const { return bytes[i]; }
+  const uint8_t *data() const { return bytes; }
+
+  constexpr std::array<uint8_t, N> to_array() const {
+    return to_array(MakeIndexSequence<N>());
+  }
+
+private:
+  template <size_t... I>
+  constexpr std::array<uint8_t, N> to_array(IndexSequence<I...>) const {
+    return std::array<uint8_t, N>{{bytes[I]...}};
+  }
+};
+
+template <typename... Bytes>
+constexpr Command<sizeof...(Bytes)> command(Bytes... bytes) {
+  return Command<sizeof...(Bytes)>{{static_cast<uint8_t>(bytes)...}};
+}
+
+template <size_t N, size_t M, size_t... I, size_t... J>
+constexpr Command<N + M> concat(const Command<N> &a, const Command<M> &b,
+                                IndexSequence<I...>, IndexSequence<J...>) {
+  return Command<N + M>{{a.bytes[I]..., b.bytes[J]...}};
+}
+
+template <size_t N, size_t M>
+constexpr Command<N + M> operator+(const Command<N> &a, const Command<M> &b) {
+  return concat(a, b, MakeIndexSequence<N>(), MakeIndexSequence<M>());
+}
+
+// The fixed-size commands of the printer
+namespace cmd {
+
+constexpr Command<2> reset() { return command(0x1b, 0x40); }
+
+// ESC a: 0 left, 1 center, 2 right
+constexpr Command<3> align(uint8_t n) { return command(0x1b, 0x61, n); }
+
+// ESC !: font, bold, double height/width and underline bits
+constexpr Command<3> print_mode(uint8_t mode) {
+  return command(0x1b, 0x21, mode);
+}
+
+// GS !: width and height multipliers minus one, in the high and low nibble
+constexpr Command<3> text_size(uint8_t size) {
+  return command(0x1d, 0x21, size);
+}
+
+constexpr Command<3> underline(uint8_t thickness) {
+  return command(0x1b, 0x2d, thickness > 2 ? 2 : thickness);
+}
+
+constexpr Command<3> bold(bool enabled) { return command(0x1b, 0x45, enabled); }
+
+constexpr Command<3> reverse(bool enabled) {
+  return command(0x1d, 0x42, enabled);
+}
+
+constexpr Command<3> upside_down(bool enabled) {
+  return command(0x1b, 0x7b, enabled);
+}
+
+constexpr Command<3> rotate_90(bool enabled) {
+  return command(0x1b, 0x56, enabled);
+}
+
+constexpr Command<3> feed_dots(uint8_t dots) {
+  return command(0x1b, 0x4a, dots);
+}
+
+constexpr Command<3> feed_lines(uint8_t lines) {
+  return command(0x1b, 0x64, lines);
+}
+
+// ESC $: absolute print position in dots
+constexpr Command<4> position(uint16_t dots) {
+  return command(0x1b, 0x24, dots & 0xff, dots >> 8);
+}
+
+// ESC 7: heating dots, heating time, heating interval
+constexpr Command<5> heating(uint8_t dots, uint8_t time, uint8_t interval) {
+  return command(0x1b, 0x37, dots, time, interval);
+}
+
+// GS r 1: transmit paper sensor status
+constexpr Command<3> paper_status() { return command(0x1d, 0x72, 0x01); }
+
+// GS v 0 header; bytes_per_line * rows of raster follow
+constexpr Command<8> raster_header(uint8_t mode, uint16_t bytes_per_line,
+                                   uint16_t rows) {
+  return command(0x1d, 0x76, 0x30, mode, bytes_per_line & 0xff,
+                 bytes_per_line >> 8, rows & 0xff, rows >> 8);
+}
+
+} // namespace cmd
+
+} // namespace em5820
+
+#endif // EM5820_COMMANDS_HPP
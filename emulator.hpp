@@ -0,0 +1,858 @@
+#ifndef EM5820_EMULATOR_HPP
+#define EM5820_EMULATOR_HPP
+
+#include "escpos_parser.hpp"
+#include "png.hpp"
+#include "printer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace em5820 {
+
+namespace detail {
+
+// 5x8 glyphs for 0x20 to 0x7e: five columns each, top dot in the LSB
+inline const uint8_t *font5x8() {
+  static const uint8_t glyphs[95 * 5]{
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5f, 0x00, 0x00, // ' ' !
+      0x00, 0x07, 0x00, 0x07, 0x00, 0x14, 0x7f, 0x14, 0x7f, 0x14, // " #
+      0x24, 0x2a, 0x7f, 0x2a, 0x12, 0x23, 0x13, 0x08, 0x64, 0x62, // $ %
+      0x36, 0x49, 0x56, 0x20, 0x50, 0x00, 0x08, 0x07, 0x03, 0x00, // & '
+      0x00, 0x1c, 0x22, 0x41, 0x00, 0x00, 0x41, 0x22, 0x1c, 0x00, // ( )
+      0x2a, 0x1c, 0x7f, 0x1c, 0x2a, 0x08, 0x08, 0x3e, 0x08, 0x08, // * +
+      0x00, 0x80, 0x70, 0x30, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, // , -
+      0x00, 0x00, 0x60, 0x60, 0x00, 0x20, 0x10, 0x08, 0x04, 0x02, // . /
+      0x3e, 0x51, 0x49, 0x45, 0x3e, 0x00, 0x42, 0x7f, 0x40, 0x00, // 0 1
+      0x72, 0x49, 0x49, 0x49, 0x46, 0x21, 0x41, 0x49, 0x4d, 0x33, // 2 3
+      0x18, 0x14, 0x12, 0x7f, 0x10, 0x27, 0x45, 0x45, 0x45, 0x39, // 4 5
+      0x3c, 0x4a, 0x49, 0x49, 0x31, 0x41, 0x21, 0x11, 0x09, 0x07, // 6 7
+      0x36, 0x49, 0x49, 0x49, 0x36, 0x46, 0x49, 0x49, 0x29, 0x1e, // 8 9
+      0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x40, 0x34, 0x00, 0x00, // : ;
+      0x00, 0x08, 0x14, 0x22, 0x41, 0x14, 0x14, 0x14, 0x14, 0x14, // < =
+      0x00, 0x41, 0x22, 0x14, 0x08, 0x02, 0x01, 0x59, 0x09, 0x06, // > ?
+      0x3e, 0x41, 0x5d, 0x59, 0x4e, 0x7c, 0x12, 0x11, 0x12, 0x7c, // @ A
+      0x7f, 0x49, 0x49, 0x49, 0x36, 0x3e, 0x41, 0x41, 0x41, 0x22, // B C
+      0x7f, 0x41, 0x41, 0x41, 0x3e, 0x7f, 0x49, 0x49, 0x49, 0x41, // D E
+      0x7f, 0x09, 0x09, 0x09, 0x01, 0x3e, 0x41, 0x41, 0x51, 0x73, // F G
+      0x7f, 0x08, 0x08, 0x08, 0x7f, 0x00, 0x41, 0x7f, 0x41, 0x00, // H I
+      0x20, 0x40, 0x41, 0x3f, 0x01, 0x7f, 0x08, 0x14, 0x22, 0x41, // J K
+      0x7f, 0x40, 0x40, 0x40, 0x40, 0x7f, 0x02, 0x1c, 0x02, 0x7f, // L M
+      0x7f, 0x04, 0x08, 0x10, 0x7f, 0x3e, 0x41, 0x41, 0x41, 0x3e, // N O
+      0x7f, 0x09, 0x09, 0x09, 0x06, 0x3e, 0x41, 0x51, 0x21, 0x5e, // P Q
+      0x7f, 0x09, 0x19, 0x29, 0x46, 0x26, 0x49, 0x49, 0x49, 0x32, // R S
+      0x03, 0x01, 0x7f, 0x01, 0x03, 0x3f, 0x40, 0x40, 0x40, 0x3f, // T U
+      0x1f, 0x20, 0x40, 0x20, 0x1f, 0x3f, 0x40, 0x38, 0x40, 0x3f, // V W
+      0x63, 0x14, 0x08, 0x14, 0x63, 0x03, 0x04, 0x78, 0x04, 0x03, // X Y
+      0x61, 0x59, 0x49, 0x4d, 0x43, 0x00, 0x7f, 0x41, 0x41, 0x41, // Z [
+      0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x41, 0x41, 0x41, 0x7f, // \ ]
+      0x04, 0x02, 0x01, 0x02, 0x04, 0x40, 0x40, 0x40, 0x40, 0x40, // ^ _
+      0x00, 0x03, 0x07, 0x08, 0x00, 0x20, 0x54, 0x54, 0x78, 0x40, // ` a
+      0x7f, 0x28, 0x44, 0x44, 0x38, 0x38, 0x44, 0x44, 0x44, 0x28, // b c
+      0x38, 0x44, 0x44, 0x28, 0x7f, 0x38, 0x54, 0x54, 0x54, 0x18, // d e
+      0x00, 0x08, 0x7e, 0x09, 0x02, 0x18, 0xa4, 0xa4, 0x9c, 0x78, // f g
+      0x7f, 0x08, 0x04, 0x04, 0x78, 0x00, 0x44, 0x7d, 0x40, 0x00, // h i
+      0x20, 0x40, 0x40, 0x3d, 0x00, 0x7f, 0x10, 0x28, 0x44, 0x00, // j k
+      0x00, 0x41, 0x7f, 0x40, 0x00, 0x7c, 0x04, 0x78, 0x04, 0x78, // l m
+      0x7c, 0x08, 0x04, 0x04, 0x78, 0x38, 0x44, 0x44, 0x44, 0x38, // n o
+      0xfc, 0x18, 0x24, 0x24, 0x18, 0x18, 0x24, 0x24, 0x18, 0xfc, // p q
+      0x7c, 0x08, 0x04, 0x04, 0x08, 0x48, 0x54, 0x54, 0x54, 0x24, // r s
+      0x04, 0x04, 0x3f, 0x44, 0x24, 0x3c, 0x40, 0x40, 0x20, 0x7c, // t u
+      0x1c, 0x20, 0x40, 0x20, 0x1c, 0x3c, 0x40, 0x30, 0x40, 0x3c, // v w
+      0x44, 0x28, 0x10, 0x28, 0x44, 0x4c, 0x90, 0x90, 0x90, 0x7c, // x y
+      0x44, 0x64, 0x54, 0x4c, 0x44, 0x00, 0x08, 0x36, 0x41, 0x00, // z {
+      0x00, 0x00, 0x77, 0x00, 0x00, 0x00, 0x41, 0x36, 0x08, 0x00, // | }
+      0x02, 0x01, 0x02, 0x04, 0x02};                              // ~
+  return glyphs;
+}
+
+// Set (or, with flip, toggle) a rectangle of dots, clipped to the bitmap
+inline void fill_dots(Bitmap1View bitmap, uint32_t x, uint32_t y, uint32_t w,
+                      uint32_t h, bool flip = false) {
+  uint32_t right = std::min<uint32_t>(x + w, bitmap.width);
+  uint32_t bottom = std::min<uint32_t>(y + h, bitmap.height);
+  for (uint32_t row = y; row < bottom; ++row) {
+    uint8_t *p = bitmap.row(row);
+    for (uint32_t col = x; col < right; ++col) {
+      uint8_t bit = static_cast<uint8_t>(0x80 >> (col & 7));
+      p[col >> 3] = flip ? p[col >> 3] ^ bit : p[col >> 3] | bit;
+    }
+  }
+}
+
+// Cheap deterministic hash for the stand-in code patterns
+inline uint32_t fnv1a(const std::string &data, uint32_t seed = 2166136261u) {
+  uint32_t h = seed;
+  for (char c : data)
+    h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+  return h;
+}
+
+} // namespace detail
+
+// A software EM5820 on the far side of a Transport. It decodes the exact
+// bytes a Printer sends, prints them onto a paper bitmap at 8 dots/mm and
+// runs a model of the mechanism alongside, so a job can be compared with a
+// golden image and timed without a printer or paper.
+//
+// What is printed:
+//   - GS v 0, ESC * and GS ( L / GS 8 L graphics dot for dot
+//   - text in a 12x24 cell per character, with size, bold, underline,
+//     reverse, upside-down and alignment. The glyphs are a built-in 5x8
+//     font at twice its size: layout and ink match the printer, letter
+//     shapes do not. ESC V is not rendered.
+//   - barcodes, QR and PDF417 codes as stand-in patterns of about the size
+//     the printer would print; they do not scan
+//
+// Timing: every dot line the paper moves costs HeatModel::line_time_us()
+// of its black dots. Bytes pass through the receive buffer; the host sends
+// at link speed until the buffer is full and then as fast as printing
+// frees it. A status request is answered once everything before it has
+// printed.
+class Emulator : public Transport {
+public:
+  struct Settings {
+    uint16_t print_width = 384;          // dots, 48 mm at 8 dots/mm
+    uint32_t buffer_bytes = 4096;        // receive buffer of the printer
+    uint32_t link_bytes_per_s = 1000000; // host to printer
+    Printer::HeatModel heat;             // ESC 7 changes it as it would
+    bool raster_reverse = false;         // GS B inverts rasters too
+    bool answers_gs_i = true;            // false: a clone that stays silent
+    std::string manufacturer = "EM5820";
+    std::string model = "EM5820 emulator";
+    std::string firmware = "1.0";
+  };
+
+  Emulator() : Emulator(Settings()) {}
+
+  explicit Emulator(const Settings &settings)
+      : settings(settings), heat(settings.heat) {
+    if (settings.print_width == 0 || settings.print_width % 8 != 0)
+      throw std::runtime_error("Print width must be a multiple of 8");
+    reset_state();
+  }
+
+  size_t write(const uint8_t *data, size_t size) override {
+    stream.feed(data, size,
+                [this](const EscPosCommand &command) { execute(command); });
+    return size;
+  }
+
+  size_t read(uint8_t *buffer, size_t size, unsigned) override {
+    size_t n = std::min(size, replies.size());
+    std::copy(replies.begin(), replies.begin() + n, buffer);
+    replies.erase(0, n);
+    return n;
+  }
+
+  std::string manufacturer() override { return settings.manufacturer; }
+  std::string product() override { return settings.model; }
+
+  // End of the job. A command cut off at the end is dropped and text
+  // without a line feed stays unprinted, as on the printer.
+  void finish() {
+    stream.finish(
+        [this](const EscPosCommand &command) { execute(command); });
+  }
+
+  // The paper printed so far, top first
+  ConstBitmap1View get_paper() const {
+    return ConstBitmap1View(sheet.data(), settings.print_width,
+                            std::max(cursor_y, inked_rows));
+  }
+
+  // Time from the first byte until the mechanism stops
+  double get_seconds() const { return std::max(host_us, mech_us) / 1e6; }
+
+  // Dot lines the paper moved
+  uint64_t get_dot_lines() const { return cursor_y; }
+
+  // Bytes the emulator could not decode
+  uint64_t get_unknown_bytes() const { return unknown_bytes; }
+
+  // Blank paper, clock at zero, power-on state
+  void clear() {
+    stream = EscPosStream();
+    replies.clear();
+    sheet.clear();
+    cursor_y = inked_rows = 0;
+    heat = settings.heat;
+    host_us = mech_us = 0;
+    received = consumed = 0;
+    pending.clear();
+    unknown_bytes = 0;
+    reset_state();
+  }
+
+private:
+  struct Style {
+    uint8_t width = 1; // multipliers of the 12x24 cell
+    uint8_t height = 1;
+    bool bold = false;
+    uint8_t underline = 0; // dots
+    bool reverse = false;
+  };
+
+  struct Glyph {
+    uint32_t x;
+    uint8_t code;
+    Style style;
+  };
+
+  struct Image {
+    uint32_t x;
+    Bitmap1 bitmap;
+  };
+
+  // Bytes up to end leave the buffer once the mechanism reaches done_us
+  struct Pending {
+    uint64_t end;
+    double done_us;
+  };
+
+  static constexpr uint32_t CELL_WIDTH = 12;
+  static constexpr uint32_t CELL_HEIGHT = 24;
+  static constexpr uint16_t DEFAULT_LINE_SPACING = 30;
+
+  Settings settings;
+  Printer::HeatModel heat;
+  EscPosStream stream;
+  std::string replies;
+
+  // Paper: rows of print_width dots; cursor_y is where the next line
+  // prints, inked_rows covers dots drawn below it (e.g. ESC * bands)
+  std::vector<uint8_t> sheet;
+  uint32_t cursor_y = 0;
+  uint32_t inked_rows = 0;
+
+  // Line buffer
+  std::vector<Glyph> glyphs;
+  std::vector<Image> images;
+  uint32_t cursor_x = 0;
+  uint32_t line_right = 0;
+
+  // Modes
+  Style style;
+  uint8_t alignment = 0;
+  bool upside_down = false;
+  uint16_t line_spacing = DEFAULT_LINE_SPACING;
+  uint8_t barcode_module = 3;
+  uint8_t barcode_height = 162;
+  uint8_t barcode_hri = 0;
+  uint8_t qr_module = 3;
+  uint8_t qr_level = 0;
+  std::string qr_data;
+  uint8_t pdf417_columns = 0, pdf417_rows = 0, pdf417_module = 3,
+          pdf417_row_height = 3, pdf417_level = 1;
+  std::string pdf417_data;
+  Bitmap1 graphic; // GS ( L fn 112, printed by fn 50
+  uint8_t graphic_sx = 1, graphic_sy = 1;
+
+  // Clock
+  double host_us = 0;
+  double mech_us = 0;
+  uint64_t received = 0;
+  uint64_t consumed = 0;
+  std::deque<Pending> pending;
+  uint64_t unknown_bytes = 0;
+
+  void reset_state() {
+    glyphs.clear();
+    images.clear();
+    cursor_x = line_right = 0;
+    style = Style();
+    alignment = 0;
+    upside_down = false;
+    line_spacing = DEFAULT_LINE_SPACING;
+    barcode_module = 3;
+    barcode_height = 162;
+    barcode_hri = 0;
+  }
+
+  void execute(const EscPosCommand &command) {
+    const uint8_t *p = command.bytes;
+    uint8_t n = static_cast<uint8_t>(command.arg);
+    uint64_t cost = 0;
+
+    switch (command.type) {
+    case CommandType::TEXT:
+      add_text(command.payload, command.payload_size);
+      break;
+    case CommandType::LINE_FEED:
+      cost = print_line(std::max<uint32_t>(line_spacing, text_height()));
+      break;
+    case CommandType::RESET:
+      reset_state();
+      break;
+    case CommandType::ALIGN:
+      alignment = n % 48 > 2 ? 0 : n % 48;
+      break;
+    case CommandType::PRINT_MODE:
+      style.width = n & 0x20 ? 2 : 1;
+      style.height = n & 0x10 ? 2 : 1;
+      style.bold = n & 0x08;
+      style.underline = n & 0x80 ? 1 : 0;
+      break;
+    case CommandType::TEXT_SIZE:
+      style.width = static_cast<uint8_t>(std::min(8, (n >> 4) + 1));
+      style.height = static_cast<uint8_t>(std::min(8, (n & 0x0f) + 1));
+      break;
+    case CommandType::UNDERLINE:
+      style.underline = static_cast<uint8_t>(std::min(2, n % 48));
+      break;
+    case CommandType::BOLD:
+      style.bold = n & 1;
+      break;
+    case CommandType::REVERSE:
+      style.reverse = n & 1;
+      break;
+    case CommandType::UPSIDE_DOWN:
+      upside_down = n & 1;
+      break;
+    case CommandType::POSITION:
+      if (command.arg < settings.print_width)
+        cursor_x = command.arg;
+      break;
+    case CommandType::FEED_DOTS:
+      cost = print_line(n);
+      break;
+    case CommandType::FEED_LINES:
+      cost = print_line(static_cast<uint32_t>(n) * line_spacing);
+      break;
+    case CommandType::LINE_SPACING:
+      line_spacing = n;
+      break;
+    case CommandType::DEFAULT_LINE_SPACING:
+      line_spacing = DEFAULT_LINE_SPACING;
+      break;
+    case CommandType::HEATING:
+      heat.dots_per_strobe = static_cast<uint16_t>((p[2] + 1) * 8);
+      heat.strobe_us = (p[3] + p[4]) * 10;
+      break;
+    case CommandType::BARCODE_WIDTH:
+      barcode_module = std::max<uint8_t>(1, std::min<uint8_t>(n, 6));
+      break;
+    case CommandType::BARCODE_HEIGHT:
+      barcode_height = std::max<uint8_t>(1, n);
+      break;
+    case CommandType::BARCODE_HRI:
+      barcode_hri = n % 48 & 3;
+      break;
+    case CommandType::BARCODE:
+      cost = print_barcode(command);
+      break;
+    case CommandType::RASTER:
+      print_gs_v0(command);
+      return; // accounted row by row
+    case CommandType::BIT_IMAGE:
+      add_bit_image(command);
+      break;
+    case CommandType::GRAPHICS:
+      cost = graphics(command);
+      break;
+    case CommandType::CODE_2D:
+      cost = code_2d(command);
+      break;
+    case CommandType::STATUS:
+      account(command.size, 0);
+      host_us = std::max(host_us, mech_us);
+      reply(command);
+      return;
+    case CommandType::UNKNOWN:
+      unknown_bytes += command.size;
+      break;
+    default:
+      break;
+    }
+
+    account(command.size, cost);
+  }
+
+  // Feed the clock: size bytes arrive and, once printing gets to them,
+  // keep the mechanism busy for cost_us
+  void account(size_t size, uint64_t cost_us) {
+    received += size;
+    while (!pending.empty() &&
+           (received - consumed > settings.buffer_bytes ||
+            pending.front().done_us <= host_us)) {
+      host_us = std::max(host_us, pending.front().done_us);
+      consumed = pending.front().end;
+      pending.pop_front();
+    }
+    host_us += size * 1e6 / settings.link_bytes_per_s;
+    mech_us = std::max(mech_us, host_us) + cost_us;
+    pending.push_back(Pending{received, mech_us});
+  }
+
+  void reply(const EscPosCommand &command) {
+    const uint8_t *p = command.bytes;
+    if (p[0] == 0x10) {
+      replies += '\x12'; // DLE EOT: online, no error
+    } else if (p[1] == 'r') {
+      replies += '\0'; // paper present
+    } else if (settings.answers_gs_i) {
+      switch (p[2]) {
+      case 1:
+        replies += '\x20';
+        break;
+      case 2:
+        replies += '\x02';
+        break;
+      case 0x41:
+        replies += '_' + settings.firmware + '\0';
+        break;
+      case 0x42:
+        replies += '_' + settings.manufacturer + '\0';
+        break;
+      case 0x43:
+        replies += '_' + settings.model + '\0';
+        break;
+      }
+    }
+  }
+
+  // Paper rows [y, y + count), grown as needed
+  Bitmap1View paper_rows(uint32_t y, uint32_t count) {
+    size_t bytes = settings.print_width / 8;
+    if (sheet.size() < (y + count) * bytes)
+      sheet.resize((y + count) * bytes, 0);
+    return Bitmap1View(sheet.data() + y * bytes, settings.print_width, count);
+  }
+
+  // OR a band onto the paper, dy rows below the current line
+  void stamp(ConstBitmap1View band, uint32_t x, uint32_t dy = 0) {
+    uint32_t bottom = band.height;
+    while (bottom > 0 && count_black_dots(band.row(bottom - 1),
+                                          band.bytes_per_line()) == 0)
+      --bottom;
+    if (bottom == 0)
+      return;
+    blit(band.rows(0, bottom), paper_rows(cursor_y + dy, bottom),
+         static_cast<int>(x), 0);
+    inked_rows = std::max(inked_rows, cursor_y + dy + bottom);
+  }
+
+  // Move the paper; returns the time the mechanism takes for it
+  uint64_t feed(uint32_t rows) {
+    Bitmap1View lines = paper_rows(cursor_y, rows);
+    uint64_t cost = 0;
+    for (uint32_t y = 0; y < rows; ++y)
+      cost += heat.line_time_us(
+          count_black_dots(lines.row(y), lines.bytes_per_line()));
+    cursor_y += rows;
+    return cost;
+  }
+
+  uint32_t aligned_x(uint32_t width) const {
+    if (width >= settings.print_width)
+      return 0;
+    uint32_t space = settings.print_width - width;
+    return alignment == 1 ? space / 2 : alignment == 2 ? space : 0;
+  }
+
+  uint32_t text_height() const {
+    uint32_t h = 0;
+    for (const Glyph &g : glyphs)
+      h = std::max(h, CELL_HEIGHT * g.style.height);
+    return h;
+  }
+
+  void add_text(const uint8_t *text, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      uint8_t c = text[i];
+      if (c < 0x20)
+        continue; // CR, HT and the like
+      uint32_t w = CELL_WIDTH * style.width;
+      if (cursor_x + w > settings.print_width) {
+        // Wraps like a line feed; the time goes with this command
+        account(0, print_line(std::max<uint32_t>(line_spacing,
+                                                 text_height())));
+        if (w > settings.print_width)
+          continue;
+      }
+      glyphs.push_back(Glyph{cursor_x, c, style});
+      cursor_x += w;
+      line_right = std::max(line_right, cursor_x);
+    }
+  }
+
+  static void draw_glyph(Bitmap1View band, uint32_t x, uint32_t y,
+                         const Glyph &g) {
+    uint32_t sw = g.style.width, sh = g.style.height;
+    uint8_t code = g.code < 0x7f ? g.code : '?';
+    const uint8_t *columns = detail::font5x8() + (code - 0x20) * 5;
+    for (uint32_t gx = 0; gx < 5; ++gx)
+      for (uint32_t gy = 0; gy < 8; ++gy)
+        if (columns[gx] >> gy & 1)
+          detail::fill_dots(band, x + (1 + 2 * gx) * sw, y + (4 + 2 * gy) * sh,
+                            (g.style.bold ? 3 : 2) * sw, 2 * sh);
+
+    uint32_t w = CELL_WIDTH * sw, h = CELL_HEIGHT * sh;
+    if (g.style.underline)
+      detail::fill_dots(band, x, y + h - g.style.underline, w,
+                        g.style.underline);
+    if (g.style.reverse)
+      detail::fill_dots(band, x, y, w, h, true);
+  }
+
+  // Print the line buffer, then move the paper by advance dots
+  uint64_t print_line(uint32_t advance) {
+    uint32_t text_h = text_height();
+    uint32_t band_h = text_h;
+    for (const Image &image : images)
+      band_h = std::max(band_h, image.bitmap.get_height());
+
+    if (band_h > 0) {
+      Bitmap1 band(settings.print_width, band_h);
+      uint32_t shift = aligned_x(line_right);
+      for (const Glyph &g : glyphs)
+        draw_glyph(band.view(), shift + g.x,
+                   text_h - CELL_HEIGHT * g.style.height, g);
+      for (const Image &image : images)
+        blit(image.bitmap.view(), band.view(),
+             static_cast<int>(shift + image.x), 0);
+      if (upside_down)
+        rotate180(band.view());
+      stamp(band.view(), 0);
+    }
+
+    glyphs.clear();
+    images.clear();
+    cursor_x = line_right = 0;
+    return feed(advance);
+  }
+
+  uint64_t flush_line() {
+    if (glyphs.empty() && images.empty())
+      return 0;
+    return print_line(std::max<uint32_t>(line_spacing, text_height()));
+  }
+
+  // Print packed rows at the current line, sx and sy times magnified.
+  // on_row(cost_us) is called for every source row.
+  template <typename RowDone>
+  void print_raster(ConstBitmap1View rows, uint32_t sx, uint32_t sy,
+                    RowDone on_row) {
+    uint32_t width = rows.width * sx;
+    uint32_t x = aligned_x(width);
+    size_t bytes = rows.bytes_per_line();
+    std::vector<uint8_t> line(bytes * sx);
+    const uint16_t *doubled = detail::doubled_bits();
+
+    for (uint32_t y = 0; y < rows.height; ++y) {
+      const uint8_t *src = rows.row(y);
+      for (size_t i = 0; i < bytes; ++i) {
+        if (sx == 2) {
+          line[2 * i] = static_cast<uint8_t>(doubled[src[i]] >> 8);
+          line[2 * i + 1] = static_cast<uint8_t>(doubled[src[i]]);
+        } else {
+          line[i] = src[i];
+        }
+      }
+      Bitmap1View scaled(line.data(), static_cast<uint16_t>(width), 1);
+      if (style.reverse && settings.raster_reverse)
+        invert(scaled);
+      for (uint32_t k = 0; k < sy; ++k)
+        stamp(scaled, x, k);
+      on_row(feed(sy));
+    }
+  }
+
+  void print_gs_v0(const EscPosCommand &command) {
+    account(0, flush_line());
+    uint32_t bytes = std::min<uint32_t>(command.width,
+                                        settings.print_width / 8);
+    uint32_t sx = command.arg & 1 ? 2 : 1, sy = command.arg & 2 ? 2 : 1;
+    ConstBitmap1View rows(command.payload, static_cast<uint16_t>(bytes * 8),
+                          command.height, command.width);
+
+    // Rows leave the buffer one by one, so large images stream through it
+    size_t header = command.size - command.payload_size;
+    bool first = true;
+    print_raster(rows, sx, sy, [&](uint64_t cost) {
+      account(command.width + (first ? header : 0), cost);
+      first = false;
+    });
+    if (first)
+      account(command.size, 0);
+  }
+
+  // ESC *: a band of columns joins the line buffer
+  void add_bit_image(const EscPosCommand &command) {
+    uint32_t m = command.arg, columns = command.width;
+    uint32_t height = m >= 32 ? 24 : 8;
+    uint32_t sx = m & 1 ? 1 : 2;
+    uint32_t width = std::min<uint32_t>(columns * sx,
+                                        settings.print_width - cursor_x);
+    if (width == 0)
+      return;
+
+    Bitmap1 band(static_cast<uint16_t>((width + 7) / 8 * 8), height);
+    size_t depth = height / 8;
+    for (uint32_t c = 0; c < columns && c * sx < width; ++c)
+      for (uint32_t k = 0; k < depth; ++k)
+        for (uint32_t b = 0; b < 8; ++b)
+          if (command.payload[c * depth + k] & (0x80 >> b))
+            detail::fill_dots(band.view(), c * sx, k * 8 + b, sx, 1);
+
+    images.push_back(Image{cursor_x, std::move(band)});
+    cursor_x += width;
+    line_right = std::max(line_right, cursor_x);
+  }
+
+  // GS ( L / GS 8 L: fn 112 stores a graphic, fn 2 or 50 prints it
+  uint64_t graphics(const EscPosCommand &command) {
+    size_t header = command.bytes[1] == '(' ? 5 : 7;
+    if (command.size < header + 2)
+      return 0;
+    uint8_t fn = command.bytes[header + 1];
+
+    if (fn == 112 && command.payload_size >= 8) {
+      const uint8_t *p = command.payload;
+      uint32_t width = command.width, height = command.height;
+      size_t bytes = (width + 7) / 8;
+      if (command.payload_size - 8 < bytes * height)
+        return 0;
+      graphic = Bitmap1(static_cast<uint16_t>(bytes * 8), height,
+                        std::vector<uint8_t>(p + 8, p + 8 + bytes * height));
+      graphic_sx = p[1] == 2 ? 2 : 1;
+      graphic_sy = p[2] == 2 ? 2 : 1;
+      return 0;
+    }
+    if ((fn == 2 || fn == 50) && graphic.get_height() > 0) {
+      uint64_t cost = flush_line();
+      print_raster(graphic.view(), graphic_sx, graphic_sy,
+                   [&](uint64_t row_cost) { cost += row_cost; });
+      return cost;
+    }
+    return 0;
+  }
+
+  uint64_t print_symbol(const Bitmap1 &symbol) {
+    uint64_t cost = flush_line();
+    stamp(symbol.view(), 0);
+    return cost + feed(symbol.get_height());
+  }
+
+  // A bitmap of print_width holding a w x h box at the aligned position
+  Bitmap1 symbol_band(uint32_t w, uint32_t h, uint32_t &x) const {
+    w = std::min<uint32_t>(w, settings.print_width);
+    x = aligned_x(w);
+    return Bitmap1(settings.print_width, h);
+  }
+
+  static std::string hri_text(const std::string &data, uint32_t m) {
+    if (m != 73)
+      return data;
+    // CODE128: drop code set selectors, unescape {{
+    std::string text;
+    for (size_t i = 0; i < data.size(); ++i) {
+      if (data[i] == '{' && i + 1 < data.size()) {
+        if (data[++i] == '{')
+          text += '{';
+      } else {
+        text += data[i];
+      }
+    }
+    return text;
+  }
+
+  uint64_t print_barcode(const EscPosCommand &command) {
+    std::string data(reinterpret_cast<const char *>(command.payload),
+                     command.payload_size);
+    uint32_t m = command.arg >= 65 ? command.arg : command.arg + 65;
+    std::string text = hri_text(data, m);
+    if (data.empty())
+      return 0;
+
+    // Modules of each symbology, roughly
+    uint32_t n = static_cast<uint32_t>(text.size()), modules;
+    switch (m) {
+    case 65: // UPC-A
+    case 67: // EAN13
+      modules = 95;
+      break;
+    case 66: // UPC-E
+      modules = 51;
+      break;
+    case 68: // EAN8
+      modules = 67;
+      break;
+    case 69: // CODE39
+      modules = (n + 2) * 13;
+      break;
+    case 70: // ITF
+      modules = n * 9 + 9;
+      break;
+    case 71: // CODABAR
+      modules = (n + 2) * 12;
+      break;
+    case 72: // CODE93
+      modules = (n + 4) * 9 + 1;
+      break;
+    default: // CODE128
+      modules = (n + 2) * 11 + 13;
+      break;
+    }
+
+    uint32_t text_rows = CELL_HEIGHT;
+    uint32_t above = barcode_hri & 1 ? text_rows : 0;
+    uint32_t below = barcode_hri & 2 ? text_rows : 0;
+    uint32_t x;
+    Bitmap1 band = symbol_band(modules * barcode_module,
+                               above + barcode_height + below, x);
+
+    uint32_t h = detail::fnv1a(data);
+    for (uint32_t i = 0; i < modules; ++i) {
+      bool black = i < 2 || i + 2 >= modules ? i % 2 == 0
+                                             : (h >> (i % 32) ^ i / 32) & 1;
+      if (black)
+        detail::fill_dots(band.view(), x + i * barcode_module, above,
+                          barcode_module, barcode_height);
+    }
+
+    uint32_t text_x = aligned_x(static_cast<uint32_t>(text.size()) *
+                                CELL_WIDTH);
+    for (size_t i = 0; i < text.size(); ++i) {
+      Glyph g{0, static_cast<uint8_t>(text[i]), Style()};
+      if (above)
+        draw_glyph(band.view(), text_x + i * CELL_WIDTH, 0, g);
+      if (below)
+        draw_glyph(band.view(), text_x + i * CELL_WIDTH,
+                   above + barcode_height, g);
+    }
+    return print_symbol(band);
+  }
+
+  // A square of modules with finder patterns in three corners
+  Bitmap1 stand_in_qr(const std::string &data) const {
+    // Byte capacity of versions 1-40 at level M; L, Q and H scaled
+    static const uint16_t capacity[40]{
+        14,   26,   42,   62,   84,   106,  122,  152,  180,  213,
+        251,  287,  331,  362,  412,  450,  504,  560,  624,  666,
+        711,  779,  857,  911,  997,  1059, 1125, 1190, 1264, 1370,
+        1452, 1538, 1628, 1722, 1809, 1911, 1989, 2099, 2213, 2331};
+    static const double level_scale[4]{1.27, 1.0, 0.72, 0.55};
+    int version = 1;
+    while (version < 40 &&
+           capacity[version - 1] * level_scale[qr_level] < data.size())
+      ++version;
+
+    uint32_t modules = 17 + 4 * version, size = modules * qr_module;
+    uint32_t x;
+    Bitmap1 band = symbol_band(size, size, x);
+    uint32_t h = detail::fnv1a(data);
+    for (uint32_t r = 0; r < modules; ++r) {
+      for (uint32_t c = 0; c < modules; ++c) {
+        bool black;
+        uint32_t fr = r, fc = c;
+        if (fr >= modules - 7 && fc < 7)
+          fr -= modules - 7;
+        else if (fc >= modules - 7 && fr < 7)
+          fc -= modules - 7;
+        if (fr < 7 && fc < 7) {
+          uint32_t ring = std::min(std::min(fr, fc), std::min(6 - fr, 6 - fc));
+          black = ring != 1;
+        } else if (fr < 8 && fc < 8) {
+          black = false;
+        } else {
+          h = h * 1103515245u + 12345u;
+          black = h >> 16 & 1;
+        }
+        if (black)
+          detail::fill_dots(band.view(), x + c * qr_module, r * qr_module,
+                            qr_module, qr_module);
+      }
+    }
+    return band;
+  }
+
+  Bitmap1 stand_in_pdf417(const std::string &data) const {
+    uint32_t codewords = static_cast<uint32_t>(data.size() * 10 / 18) + 1 +
+                         (2u << pdf417_level);
+    uint32_t columns = pdf417_columns;
+    if (columns == 0) {
+      columns = 1;
+      while (columns < 30 && columns * columns * 3 < codewords)
+        ++columns;
+    }
+    uint32_t rows = pdf417_rows;
+    if (rows == 0)
+      rows = std::min<uint32_t>(90, std::max<uint32_t>(
+                                        3, (codewords + columns - 1) / columns));
+
+    uint32_t modules = 17 * (columns + 4) + 1;
+    uint32_t row_h = pdf417_row_height * pdf417_module;
+    uint32_t x;
+    Bitmap1 band = symbol_band(modules * pdf417_module, rows * row_h, x);
+    uint32_t h = detail::fnv1a(data);
+    for (uint32_t r = 0; r < rows; ++r) {
+      for (uint32_t c = 0; c < modules; ++c) {
+        h = h * 1103515245u + 12345u;
+        bool guard = c < 8 || c + 9 >= modules;
+        if (guard ? c % 2 == 0 : h >> 16 & 1)
+          detail::fill_dots(band.view(), x + c * pdf417_module, r * row_h,
+                            pdf417_module, row_h);
+      }
+    }
+    return band;
+  }
+
+  // GS ( k: cn 49 QR, cn 48 PDF417; fn 80 stores the data, fn 81 prints
+  uint64_t code_2d(const EscPosCommand &command) {
+    if (command.size < 8)
+      return 0;
+    uint8_t cn = command.bytes[5], fn = command.bytes[6];
+    const uint8_t *p = command.payload;
+    uint8_t value = p[0];
+
+    if (fn == 0x50) {
+      std::string data(reinterpret_cast<const char *>(p) + 1,
+                       command.payload_size - 1);
+      (cn == 0x31 ? qr_data : pdf417_data) = data;
+      return 0;
+    }
+    if (fn == 0x51) {
+      const std::string &data = cn == 0x31 ? qr_data : pdf417_data;
+      if (data.empty())
+        return 0;
+      return print_symbol(cn == 0x31 ? stand_in_qr(data)
+                                     : stand_in_pdf417(data));
+    }
+
+    if (cn == 0x31) {
+      if (fn == 0x43)
+        qr_module = std::max<uint8_t>(1, std::min<uint8_t>(value, 16));
+      else if (fn == 0x45)
+        qr_level = (value - 0x30) & 3;
+    } else if (cn == 0x30) {
+      switch (fn) {
+      case 0x41:
+        pdf417_columns = std::min<uint8_t>(value, 30);
+        break;
+      case 0x42:
+        pdf417_rows = std::min<uint8_t>(value, 90);
+        break;
+      case 0x43:
+        pdf417_module = std::max<uint8_t>(2, std::min<uint8_t>(value, 8));
+        break;
+      case 0x44:
+        pdf417_row_height = std::max<uint8_t>(2, std::min<uint8_t>(value, 8));
+        break;
+      case 0x45:
+        if (command.payload_size >= 2)
+          pdf417_level = std::min<uint8_t>((command.payload[1] - 0x30) & 0xf,
+                                           8);
+        break;
+      }
+    }
+    return 0;
+  }
+};
+
+} // namespace em5820
+
+#endif // EM5820_EMULATOR_HPP
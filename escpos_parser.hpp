@@ -0,0 +1,385 @@
+#ifndef EM5820_ESCPOS_PARSER_HPP
+#define EM5820_ESCPOS_PARSER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace em5820 {
+
+enum class CommandType : uint8_t {
+  TEXT,                 // printable bytes; payload is the run
+  LINE_FEED,            // LF
+  RESET,                // ESC @
+  ALIGN,                // ESC a n
+  PRINT_MODE,           // ESC ! n
+  TEXT_SIZE,            // GS ! n
+  UNDERLINE,            // ESC - n
+  BOLD,                 // ESC E n
+  POSITION,             // ESC $ nL nH
+  FEED_DOTS,            // ESC J n
+  FEED_LINES,           // ESC d n
+  LINE_SPACING,         // ESC 3 n
+  DEFAULT_LINE_SPACING, // ESC 2
+  HEATING,              // ESC 7 n1 n2 n3
+  CODE_PAGE,            // ESC t n
+  REVERSE,              // GS B n
+  UPSIDE_DOWN,          // ESC { n
+  ROTATE,               // ESC V n
+  BARCODE_WIDTH,        // GS w n
+  BARCODE_HEIGHT,       // GS h n
+  BARCODE_HRI,          // GS H n
+  BARCODE,              // GS k; payload is the data
+  RASTER,               // GS v 0; payload is the rows
+  BIT_IMAGE,            // ESC *; payload is the columns
+  GRAPHICS,             // GS ( L / GS 8 L; payload after fn
+  CODE_2D,              // GS ( k; payload after cn fn
+  STATUS,               // GS r n, GS I n, DLE EOT n
+  OTHER,                // known length, not modelled
+  UNKNOWN               // cannot be decoded; covers the rest of the input
+};
+
+inline const char *command_type_name(CommandType type) {
+  static const char *const names[]{
+      "text",        "line-feed",    "reset",          "align",
+      "print-mode",  "text-size",    "underline",      "bold",
+      "position",    "feed-dots",    "feed-lines",     "line-spacing",
+      "default-line-spacing",        "heating",        "code-page",
+      "reverse",     "upside-down",  "rotate",         "barcode-width",
+      "barcode-height",              "barcode-hri",    "barcode",
+      "raster",      "bit-image",    "graphics",       "code-2d",
+      "status",      "other",        "unknown"};
+  return names[static_cast<int>(type)];
+}
+
+// One decoded command. The pointers point into the parsed buffer and are
+// only valid during the callback.
+struct EscPosCommand {
+  CommandType type = CommandType::UNKNOWN;
+  const uint8_t *bytes = nullptr; // the whole command
+  size_t size = 0;
+  const uint8_t *payload = nullptr; // text, image or code data
+  size_t payload_size = 0;
+  uint32_t arg = 0;    // first parameter: n, dots for ESC $, mode for GS v 0
+  uint32_t width = 0;  // RASTER: bytes per line; BIT_IMAGE, GRAPHICS: dots
+  uint32_t height = 0; // RASTER, GRAPHICS: rows
+};
+
+namespace detail {
+
+// How the length of a command is found
+enum class Form : uint8_t {
+  FIXED,    // length bytes
+  ESC_STAR, // ESC * m nL nH, columns of 1 or 3 bytes
+  GS_V0,    // GS v 0 m xL xH yL yH, x * y bytes
+  GS_PAREN, // GS ( fn pL pH, p bytes
+  GS_8L,    // GS 8 L p1 p2 p3 p4, p bytes
+  GS_K,     // GS k m: NUL terminated (m < 65) or counted (m >= 65)
+  DLE       // DLE EOT n / DLE ENQ n
+};
+
+struct Rule {
+  CommandType type;
+  Form form;
+  uint8_t length; // FIXED: bytes including prefix; 0 = no such command
+};
+
+// Rules for the second byte after ESC (0), GS (1) and DLE (2), and which
+// first bytes start a command
+struct Tables {
+  Rule rules[3][256];
+  int8_t prefix[256];
+
+  Tables() : rules() {
+    for (int i = 0; i < 256; ++i)
+      prefix[i] = -1;
+    prefix[0x1b] = 0;
+    prefix[0x1d] = 1;
+    prefix[0x10] = 2;
+    prefix[0x1c] = 3; // FS: not modelled, decodes as UNKNOWN
+
+    auto esc = [&](char c, CommandType type, uint8_t length) {
+      rules[0][static_cast<uint8_t>(c)] = Rule{type, Form::FIXED, length};
+    };
+    auto gs = [&](char c, CommandType type, uint8_t length) {
+      rules[1][static_cast<uint8_t>(c)] = Rule{type, Form::FIXED, length};
+    };
+
+    esc('@', CommandType::RESET, 2);
+    esc('2', CommandType::DEFAULT_LINE_SPACING, 2);
+    esc('a', CommandType::ALIGN, 3);
+    esc('!', CommandType::PRINT_MODE, 3);
+    esc('-', CommandType::UNDERLINE, 3);
+    esc('E', CommandType::BOLD, 3);
+    esc('J', CommandType::FEED_DOTS, 3);
+    esc('d', CommandType::FEED_LINES, 3);
+    esc('3', CommandType::LINE_SPACING, 3);
+    esc('t', CommandType::CODE_PAGE, 3);
+    esc('{', CommandType::UPSIDE_DOWN, 3);
+    esc('V', CommandType::ROTATE, 3);
+    esc('G', CommandType::OTHER, 3); // double strike
+    esc('M', CommandType::OTHER, 3); // font
+    esc('R', CommandType::OTHER, 3); // character set
+    esc(' ', CommandType::OTHER, 3); // character spacing
+    esc('$', CommandType::POSITION, 4);
+    esc('7', CommandType::HEATING, 5);
+    rules[0]['*'] = Rule{CommandType::BIT_IMAGE, Form::ESC_STAR, 5};
+
+    gs('!', CommandType::TEXT_SIZE, 3);
+    gs('B', CommandType::REVERSE, 3);
+    gs('w', CommandType::BARCODE_WIDTH, 3);
+    gs('h', CommandType::BARCODE_HEIGHT, 3);
+    gs('H', CommandType::BARCODE_HRI, 3);
+    gs('r', CommandType::STATUS, 3);
+    gs('I', CommandType::STATUS, 3);
+    gs('f', CommandType::OTHER, 3); // HRI font
+    gs('L', CommandType::OTHER, 4); // left margin
+    gs('W', CommandType::OTHER, 4); // print area width
+    rules[1]['v'] = Rule{CommandType::RASTER, Form::GS_V0, 8};
+    rules[1]['('] = Rule{CommandType::OTHER, Form::GS_PAREN, 5};
+    rules[1]['8'] = Rule{CommandType::GRAPHICS, Form::GS_8L, 7};
+    rules[1]['k'] = Rule{CommandType::BARCODE, Form::GS_K, 4};
+
+    rules[2][0x04] = Rule{CommandType::STATUS, Form::DLE, 3};
+    rules[2][0x05] = Rule{CommandType::OTHER, Form::DLE, 3};
+  }
+};
+
+inline const Tables &tables() {
+  static const Tables t;
+  return t;
+}
+
+inline uint32_t u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+// Outcome of decoding the start of a buffer
+enum class Decoded { COMPLETE, NEED_MORE, UNKNOWN };
+
+// Decode the command at p. COMPLETE fills out; NEED_MORE sets need to the
+// number of bytes that settles the question (at least n + 1).
+inline Decoded decode(const uint8_t *p, size_t n, EscPosCommand &out,
+                      size_t &need) {
+  const Tables &t = tables();
+  out = EscPosCommand();
+  out.bytes = p;
+
+  int prefix = t.prefix[p[0]];
+  if (prefix < 0) {
+    // Run of text up to the next command or line feed
+    size_t i = 0;
+    if (p[0] == 0x0a) {
+      i = 1;
+      out.type = CommandType::LINE_FEED;
+    } else {
+      while (i < n && t.prefix[p[i]] < 0 && p[i] != 0x0a)
+        ++i;
+      out.type = CommandType::TEXT;
+      out.payload = p;
+      out.payload_size = i;
+    }
+    out.size = i;
+    return Decoded::COMPLETE;
+  }
+  if (prefix == 3)
+    return Decoded::UNKNOWN;
+  if (n < 2) {
+    need = 2;
+    return Decoded::NEED_MORE;
+  }
+
+  const Rule &rule = t.rules[prefix][p[1]];
+  if (rule.length == 0)
+    return Decoded::UNKNOWN;
+  if (n < rule.length) {
+    need = rule.length;
+    return Decoded::NEED_MORE;
+  }
+
+  out.type = rule.type;
+  size_t header = rule.length, body = 0;
+
+  switch (rule.form) {
+  case Form::FIXED:
+  case Form::DLE:
+    out.arg = rule.length >= 3 ? p[2] : 0;
+    if (rule.type == CommandType::POSITION)
+      out.arg = u16(p + 2);
+    break;
+  case Form::ESC_STAR:
+    out.arg = p[2];
+    out.width = u16(p + 3);
+    body = p[2] >= 32 ? out.width * 3 : out.width;
+    break;
+  case Form::GS_V0:
+    if (p[2] != '0')
+      return Decoded::UNKNOWN;
+    out.arg = p[3];
+    out.width = u16(p + 4);
+    out.height = u16(p + 6);
+    body = static_cast<size_t>(out.width) * out.height;
+    break;
+  case Form::GS_PAREN:
+    // pL pH count the bytes after them: fn (and cn) lead the payload
+    body = u16(p + 3);
+    out.arg = p[2];
+    if (p[2] == 'L')
+      out.type = CommandType::GRAPHICS;
+    else if (p[2] == 'k')
+      out.type = CommandType::CODE_2D;
+    break;
+  case Form::GS_8L:
+    if (p[2] != 'L')
+      return Decoded::UNKNOWN;
+    body = p[3] | p[4] << 8 | static_cast<size_t>(p[5]) << 16 |
+           static_cast<size_t>(p[6]) << 24;
+    out.arg = 'L';
+    break;
+  case Form::GS_K:
+    out.arg = p[2];
+    if (p[2] >= 65) {
+      body = p[3];
+    } else {
+      // Function A: data runs to a NUL; header ends at m
+      header = 3;
+      size_t i = 3;
+      while (i < n && p[i] != 0)
+        ++i;
+      if (i == n) {
+        need = n + 1;
+        return Decoded::NEED_MORE;
+      }
+      body = i - 3 + 1;
+    }
+    break;
+  }
+
+  if (n - header < body) {
+    need = header + body;
+    return Decoded::NEED_MORE;
+  }
+
+  out.size = header + body;
+  if (out.type == CommandType::GRAPHICS || out.type == CommandType::CODE_2D) {
+    // The payload follows m fn (graphics) or cn fn (2D codes)
+    size_t lead = std::min<size_t>(2, body);
+    out.payload = p + header + lead;
+    out.payload_size = body - lead;
+    if (out.type == CommandType::GRAPHICS && out.payload_size >= 8 &&
+        p[header + 1] == 112) {
+      // fn 112: a tone, bx, by, c, then xL xH yL yH
+      out.width = u16(out.payload + 4);
+      out.height = u16(out.payload + 6);
+    }
+  } else {
+    out.payload = p + header;
+    out.payload_size = rule.type == CommandType::BARCODE && p[2] < 65
+                           ? body - 1
+                           : body;
+  }
+  return Decoded::COMPLETE;
+}
+
+} // namespace detail
+
+// Decode the whole commands in data and call on_command(const
+// EscPosCommand &) for each. Stops before a command cut off at the end and
+// returns the number of bytes consumed; an undecodable byte produces one
+// UNKNOWN command covering the rest, since there is no way to resync.
+template <typename Handler>
+size_t parse_escpos(const uint8_t *data, size_t size, Handler &&on_command) {
+  EscPosCommand command;
+  size_t need;
+  size_t i = 0;
+  while (i < size) {
+    switch (detail::decode(data + i, size - i, command, need)) {
+    case detail::Decoded::COMPLETE:
+      on_command(command);
+      i += command.size;
+      break;
+    case detail::Decoded::NEED_MORE:
+      return i;
+    case detail::Decoded::UNKNOWN:
+      command = EscPosCommand();
+      command.bytes = command.payload = data + i;
+      command.size = command.payload_size = size - i;
+      on_command(command);
+      return size;
+    }
+  }
+  return i;
+}
+
+// Incremental decoder for a stream that arrives in arbitrary pieces. Whole
+// commands are decoded in place; only a command cut by a piece boundary is
+// copied, into a buffer that is reused.
+class EscPosStream {
+public:
+  template <typename Handler>
+  void feed(const uint8_t *data, size_t size, Handler &&on_command) {
+    if (lost) {
+      emit_unknown(data, size, on_command);
+      return;
+    }
+
+    while (!carry.empty()) {
+      EscPosCommand command;
+      size_t need = 0;
+      detail::Decoded state =
+          detail::decode(carry.data(), carry.size(), command, need);
+      if (state == detail::Decoded::NEED_MORE) {
+        if (size == 0)
+          return;
+        size_t take = std::min(need - carry.size(), size);
+        carry.insert(carry.end(), data, data + take);
+        data += take;
+        size -= take;
+        continue;
+      }
+      if (state == detail::Decoded::UNKNOWN) {
+        lost = true;
+        emit_unknown(carry.data(), carry.size(), on_command);
+        carry.clear();
+        emit_unknown(data, size, on_command);
+        return;
+      }
+      // Text never waits for more, so a complete carry is one command
+      on_command(command);
+      carry.erase(carry.begin(), carry.begin() + command.size);
+    }
+
+    size_t used = parse_escpos(data, size, [&](const EscPosCommand &c) {
+      if (c.type == CommandType::UNKNOWN)
+        lost = true;
+      on_command(c);
+    });
+    carry.assign(data + used, data + size);
+  }
+
+  // End of stream: a cut-off command is reported as UNKNOWN
+  template <typename Handler> void finish(Handler &&on_command) {
+    if (!carry.empty())
+      emit_unknown(carry.data(), carry.size(), on_command);
+    carry.clear();
+    lost = false;
+  }
+
+private:
+  std::vector<uint8_t> carry;
+  bool lost = false; // past an undecodable byte: pass everything through
+
+  template <typename Handler>
+  static void emit_unknown(const uint8_t *data, size_t size,
+                           Handler &on_command) {
+    if (size == 0)
+      return;
+    EscPosCommand command;
+    command.bytes = command.payload = data;
+    command.size = command.payload_size = size;
+    on_command(command);
+  }
+};
+
+} // namespace em5820
+
+#endif // EM5820_ESCPOS_PARSER_HPP
@@ -1,60 +1,224 @@
+#include "capture.hpp"
+#include "emulator.hpp"
 #include "printer.hpp"
 #include <cstdint>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <string>
 #include <cmath>
 #include <algorithm>
+#include <chrono>
+#include <getopt.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 using namespace em5820;
 
-// Convert RGB to grayscale with gamma correction
-float rgb_to_gray(uint8_t r, uint8_t g, uint8_t b) {
-    // Standard luminance formula
-    float gray = 0.299f * r + 0.587f * g + 0.114f * b;
-    // Apply gamma correction (2.2 is standard)
-    return std::pow(gray / 255.0f, 1.0f / 2.2f);
+// Tone adjustments applied before dithering
+struct ToneOptions {
+    float brightness = 0.0f;   // -100..100, added to the gray level
+    float contrast = 0.0f;     // -100..100, stretch around mid gray
+    float gamma = 2.2f;        // 2.2 is standard
+    float sharpen = 0.0f;      // unsharp mask amount, 0 = off
+    bool auto_levels = false;  // stretch the histogram to full range
+};
+
+// Gray level (0 = black, 1 = white) for each 8-bit luma. All point
+// operations (levels, brightness, contrast, gamma) fold into this table.
+void build_gray_lut(const ToneOptions& tone, const uint32_t histogram[256],
+                    uint32_t pixels, float lut[256]) {
+    int lo = 0, hi = 255;
+    if (tone.auto_levels && pixels > 0) {
+        // Clip 0.5% at each end so stray pixels do not pin the range
+        uint32_t clip = pixels / 200;
+        uint32_t sum = 0;
+        while (lo < 255 && (sum += histogram[lo]) <= clip) lo++;
+        sum = 0;
+        while (hi > 0 && (sum += histogram[hi]) <= clip) hi--;
+        if (hi <= lo) {
+            lo = 0;
+            hi = 255;
+        }
+    }
+    
+    float factor = (100.0f + tone.contrast) / 100.0f;
+    for (int i = 0; i < 256; i++) {
+        float t = static_cast<float>(i - lo) / (hi - lo);
+        t = (t - 0.5f) * factor + 0.5f + tone.brightness / 100.0f;
+        t = std::min(1.0f, std::max(0.0f, t));
+        lut[i] = std::pow(t, 1.0f / tone.gamma);
+    }
+}
+
+// Ask the cache for the samples of a source row ahead of its conversion.
+// On large downscaled images every sample sits on its own cache line, so
+// issuing the loads one row early hides most of the miss latency.
+void prefetch_row(const uint8_t* src_row, const int* src_offset, int n) {
+    const uint8_t* last_line = nullptr;
+    for (int x = 0; x < n; x++) {
+        const uint8_t* line = reinterpret_cast<const uint8_t*>(
+            reinterpret_cast<uintptr_t>(src_row + src_offset[x]) & ~uintptr_t(63));
+        if (line != last_line) {
+            __builtin_prefetch(line);
+            last_line = line;
+        }
+    }
+}
+
+// Integer unsharp mask of row y from its neighbours: c + amount * (c - blur)
+// with a 3x3 [1 2 1] binomial blur. amount_q8 is the amount in 1/256 units.
+void sharpen_row(const uint8_t* above, const uint8_t* row, const uint8_t* below,
+                 int n, int amount_q8, uint8_t* out) {
+    for (int x = 0; x < n; x++) {
+        int l = x > 0 ? x - 1 : x;
+        int r = x + 1 < n ? x + 1 : x;
+        int blur = above[l] + 2 * above[x] + above[r]
+                 + 2 * row[l] + 4 * row[x] + 2 * row[r]
+                 + below[l] + 2 * below[x] + below[r];
+        int v = row[x] + (((row[x] * 16 - blur) * amount_q8) >> 12);
+        out[x] = static_cast<uint8_t>(std::min(255, std::max(0, v)));
+    }
+}
+
+// Convert one row of sampled pixels to 8-bit luma, composited onto white
+// paper. Alpha is coverage: luma * a + 255 * (255 - a), so transparent
+// pixels come out white instead of whatever color sits underneath.
+// Integer-only so the compiler can vectorize it per channel count.
+template <int C>
+void luma_row(const uint8_t* src_row, const int* src_offset, int n, uint8_t* out) {
+    for (int x = 0; x < n; x++) {
+        const uint8_t* px = src_row + src_offset[x];
+
+        // Standard luminance formula, weights scaled to 256
+        uint32_t luma = C >= 3 ? (77 * px[0] + 150 * px[1] + 29 * px[2] + 128) >> 8
+                               : px[0];
+        uint32_t alpha = C == 2 ? px[1] : C == 4 ? px[3] : 255;
+
+        out[x] = static_cast<uint8_t>((luma * alpha + 255 * (255 - alpha) + 127) / 255);
+    }
+}
+
+void luma_row(int channels, const uint8_t* src_row, const int* src_offset,
+              int n, uint8_t* out) {
+    switch (channels) {
+        case 1: luma_row<1>(src_row, src_offset, n, out); break;
+        case 2: luma_row<2>(src_row, src_offset, n, out); break;
+        case 3: luma_row<3>(src_row, src_offset, n, out); break;
+        default: luma_row<4>(src_row, src_offset, n, out); break;
+    }
+}
+
+// How gray levels become dots
+enum class RenderMode { AUTO, DITHER, THRESHOLD };
+
+const int TILE_SIZE = 32;
+
+// Mark bimodal tiles: clearly dark and clearly light pixels, almost no
+// mid-tones (text, line art). Those print crisper with a plain threshold
+// than with error diffusion. Flat tiles, like sky or a dark background,
+// have one mode only and stay dithered.
+std::vector<uint8_t> classify_tiles(const std::vector<float>& grayscale,
+                                    int width, int height, int tiles_x, int tiles_y) {
+    std::vector<uint8_t> threshold(tiles_x * tiles_y);
+    
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int x0 = tx * TILE_SIZE, x1 = std::min(width, x0 + TILE_SIZE);
+            int y0 = ty * TILE_SIZE, y1 = std::min(height, y0 + TILE_SIZE);
+            
+            int dark = 0, light = 0;
+            for (int y = y0; y < y1; y++) {
+                const float* row = &grayscale[y * width];
+                for (int x = x0; x < x1; x++) {
+                    dark += row[x] <= 0.15f;
+                    light += row[x] >= 0.85f;
+                }
+            }
+            
+            // Fewer than 5% mid-tones, and at least 2% in each mode
+            int pixels = (x1 - x0) * (y1 - y0);
+            int mid_tones = pixels - dark - light;
+            threshold[ty * tiles_x + tx] = mid_tones * 20 < pixels &&
+                                           dark * 50 >= pixels && light * 50 >= pixels;
+        }
+    }
+    
+    return threshold;
+}
+
+// Threshold pixels [x0, x1) of one row straight into packed bits. x0 must
+// be a multiple of 8.
+void threshold_span(const float* row, int x0, int x1, uint8_t* out) {
+    for (int x = x0; x < x1; x += 8) {
+        uint8_t byte = 0;
+        for (int b = 0; b < 8 && x + b < x1; b++) {
+            byte |= (row[x + b] <= 0.5f) << (7 - b);
+        }
+        out[x / 8] = byte;
+    }
 }
 
-// Floyd-Steinberg dithering algorithm
-std::vector<uint8_t> dither_image(const std::vector<float>& grayscale, 
-                                   int width, int height) {
+// Floyd-Steinberg error diffusion of pixels [x0, x1) in row y
+void diffuse_span(std::vector<float>& working_copy, int width, int height,
+                  int y, int x0, int x1, uint8_t* out) {
+    for (int x = x0; x < x1; x++) {
+        int idx = y * width + x;
+        float old_pixel = working_copy[idx];
+        
+        // Quantize to black or white
+        float new_pixel = old_pixel > 0.5f ? 1.0f : 0.0f;
+        float error = old_pixel - new_pixel;
+        
+        // Set the output bit (1 = black, 0 = white for thermal printers)
+        if (new_pixel < 0.5f) {
+            out[x / 8] |= (1 << (7 - (x % 8)));
+        }
+        
+        // Distribute error to neighboring pixels (Floyd-Steinberg)
+        if (x + 1 < width)
+            working_copy[idx + 1] += error * 7.0f / 16.0f;
+        
+        if (y + 1 < height) {
+            if (x > 0)
+                working_copy[idx + width - 1] += error * 3.0f / 16.0f;
+            working_copy[idx + width] += error * 5.0f / 16.0f;
+            if (x + 1 < width)
+                working_copy[idx + width + 1] += error * 1.0f / 16.0f;
+        }
+    }
+}
+
+// Convert to 1-bit. Thresholded tiles read the original gray levels, so
+// error diffused from neighbouring photo tiles does not speckle them.
+Bitmap1 dither_image(const std::vector<float>& grayscale, 
+                     int width, int height,
+                     RenderMode mode = RenderMode::DITHER) {
     // Create a copy for error diffusion
     std::vector<float> working_copy = grayscale;
     
     // Output bitmap (1 bit per pixel, packed into bytes)
-    int bytes_per_row = (width + 7) / 8;
-    std::vector<uint8_t> bitmap(bytes_per_row * height, 0);
+    Bitmap1 bitmap(static_cast<uint16_t>(width), height);
+    Bitmap1View view = bitmap.view();
+    
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<uint8_t> threshold =
+        mode == RenderMode::AUTO
+            ? classify_tiles(grayscale, width, height, tiles_x, tiles_y)
+            : std::vector<uint8_t>(tiles_x * tiles_y, mode == RenderMode::THRESHOLD);
     
     for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int idx = y * width + x;
-            float old_pixel = working_copy[idx];
-            
-            // Quantize to black or white
-            float new_pixel = old_pixel > 0.5f ? 1.0f : 0.0f;
-            float error = old_pixel - new_pixel;
-            
-            // Set the output bit (1 = black, 0 = white for thermal printers)
-            if (new_pixel < 0.5f) {
-                int byte_idx = y * bytes_per_row + (x / 8);
-                int bit_idx = 7 - (x % 8);
-                bitmap[byte_idx] |= (1 << bit_idx);
-            }
-            
-            // Distribute error to neighboring pixels (Floyd-Steinberg)
-            if (x + 1 < width)
-                working_copy[idx + 1] += error * 7.0f / 16.0f;
-            
-            if (y + 1 < height) {
-                if (x > 0)
-                    working_copy[idx + width - 1] += error * 3.0f / 16.0f;
-                working_copy[idx + width] += error * 5.0f / 16.0f;
-                if (x + 1 < width)
-                    working_copy[idx + width + 1] += error * 1.0f / 16.0f;
+        const uint8_t* tile_row = &threshold[(y / TILE_SIZE) * tiles_x];
+        uint8_t* out = view.row(y);
+        
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int x0 = tx * TILE_SIZE, x1 = std::min(width, x0 + TILE_SIZE);
+            if (tile_row[tx]) {
+                threshold_span(&grayscale[y * width], x0, x1, out);
+            } else {
+                diffuse_span(working_copy, width, height, y, x0, x1, out);
             }
         }
     }
@@ -64,9 +228,10 @@ std::vector<uint8_t> dither_image(const std::vector<float>& grayscale,
 
 // Load and process image
 bool load_and_process_image(const std::string& filename, 
-                            std::vector<uint8_t>& bitmap,
-                            int& out_width, int& out_height,
-                            int max_width = 384) {
+                            Bitmap1& bitmap,
+                            int max_width = 384,
+                            const ToneOptions& tone = ToneOptions(),
+                            RenderMode render = RenderMode::AUTO) {
     int width, height, channels;
     uint8_t* img_data = stbi_load(filename.c_str(), &width, &height, &channels, 0);
     
@@ -79,7 +244,7 @@ bool load_and_process_image(const std::string& filename,
     std::cout << "Loaded image: " << width << "x" << height 
               << " (" << channels << " channels)" << std::endl;
     
-    // Scale image to fit printer width (384 pixels max)
+    // Scale image to fit printer width
     float scale = 1.0f;
     if (width > max_width) {
         scale = static_cast<float>(max_width) / width;
@@ -95,85 +260,445 @@ bool load_and_process_image(const std::string& filename,
     
     std::cout << "Scaled size: " << scaled_width << "x" << scaled_height << std::endl;
     
-    // Convert to grayscale and scale
-    std::vector<float> grayscale(scaled_width * scaled_height);
+    // Source byte offset of every output column
+    std::vector<int> src_offset(scaled_width);
+    for (int x = 0; x < scaled_width; x++) {
+        int src_x = std::min(static_cast<int>(x / scale), width - 1);
+        src_offset[x] = src_x * channels;
+    }
     
-    for (int y = 0; y < scaled_height; y++) {
-        for (int x = 0; x < scaled_width; x++) {
-            // Calculate source pixel position
-            int src_x = static_cast<int>(x / scale);
-            int src_y = static_cast<int>(y / scale);
-            
-            // Clamp to image bounds
-            src_x = std::min(src_x, width - 1);
-            src_y = std::min(src_y, height - 1);
-            
-            int src_idx = (src_y * width + src_x) * channels;
+    // Convert to grayscale and scale. Sharpening runs on a rolling band of
+    // three scaled rows, so row y is finished as soon as row y + 1 exists.
+    std::vector<uint8_t> luma(scaled_width * scaled_height);
+    std::vector<uint8_t> band(3 * scaled_width);
+    int amount_q8 = static_cast<int>(tone.sharpen * 256.0f);
+    uint32_t histogram[256] = {};
+    
+    // Only sparse sampling (downscale) misses the cache on every sample
+    size_t row_bytes = static_cast<size_t>(width) * channels;
+    bool prefetch = scale < 0.5f;
+    
+    for (int y = 0; y <= scaled_height; y++) {
+        uint8_t* finished = nullptr;
+        
+        if (y < scaled_height) {
+            // Calculate source row, clamped to image bounds
+            int src_y = std::min(static_cast<int>(y / scale), height - 1);
+            const uint8_t* src_row = img_data + static_cast<size_t>(src_y) * row_bytes;
             
-            uint8_t r, g, b;
-            if (channels == 1) {
-                r = g = b = img_data[src_idx];
-            } else if (channels == 2) {
-                r = g = b = img_data[src_idx];
-            } else if (channels == 3) {
-                r = img_data[src_idx];
-                g = img_data[src_idx + 1];
-                b = img_data[src_idx + 2];
-            } else { // channels == 4
-                r = img_data[src_idx];
-                g = img_data[src_idx + 1];
-                b = img_data[src_idx + 2];
+            if (prefetch && y + 1 < scaled_height) {
+                int next_y = std::min(static_cast<int>((y + 1) / scale), height - 1);
+                prefetch_row(img_data + static_cast<size_t>(next_y) * row_bytes,
+                             src_offset.data(), scaled_width);
             }
+            uint8_t* dst = amount_q8 ? &band[(y % 3) * scaled_width]
+                                     : &luma[y * scaled_width];
             
-            grayscale[y * scaled_width + x] = rgb_to_gray(r, g, b);
+            luma_row(channels, src_row, src_offset.data(), scaled_width, dst);
+            if (!amount_q8) {
+                finished = dst;
+            }
+        }
+        
+        if (amount_q8 && y > 0) {
+            // Row y - 1 now has both neighbours (edges repeat themselves)
+            int row = y - 1;
+            const uint8_t* above = &band[(row > 0 ? row - 1 : row) % 3 * scaled_width];
+            const uint8_t* below = &band[(y < scaled_height ? y : row) % 3 * scaled_width];
+            finished = &luma[row * scaled_width];
+            sharpen_row(above, &band[row % 3 * scaled_width], below,
+                        scaled_width, amount_q8, finished);
+        }
+        
+        if (finished) {
+            for (int x = 0; x < scaled_width; x++) {
+                histogram[finished[x]]++;
+            }
         }
     }
     
+    float lut[256];
+    build_gray_lut(tone, histogram, luma.size(), lut);
+    
+    std::vector<float> grayscale(luma.size());
+    for (size_t i = 0; i < luma.size(); i++) {
+        grayscale[i] = lut[luma[i]];
+    }
+    
     stbi_image_free(img_data);
     
     std::cout << "Applying Floyd-Steinberg dithering..." << std::endl;
-    bitmap = dither_image(grayscale, scaled_width, scaled_height);
-    
-    out_width = scaled_width;
-    out_height = scaled_height;
+    bitmap = dither_image(grayscale, scaled_width, scaled_height, render);
     
     return true;
 }
 
+// Shelf bin-packing: tallest images first, placed left to right along a
+// shelf until the next one no longer fits, then a new shelf below. Widths
+// are multiples of 8, so every image lands on a byte boundary and is
+// copied into a column view of the collage.
+Bitmap1 pack_collage(const std::vector<Bitmap1>& images, int max_width, int gap = 8) {
+    std::vector<size_t> order(images.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return images[a].get_height() > images[b].get_height();
+    });
+    
+    struct Placement {
+        size_t index;
+        int x, y;
+    };
+    std::vector<Placement> placements;
+    int x = 0, shelf_y = 0, shelf_height = 0, used_width = 0;
+    
+    for (size_t i : order) {
+        const Bitmap1& image = images[i];
+        int width = image.get_width(), height = image.get_height();
+        if (x > 0 && x + width > max_width) {
+            shelf_y += shelf_height + gap;
+            shelf_height = 0;
+            x = 0;
+        }
+        
+        placements.push_back(Placement{i, x, shelf_y});
+        shelf_height = std::max(shelf_height, height);
+        x += width;
+        used_width = std::max(used_width, x);
+        x += gap;
+    }
+    
+    Bitmap1 collage(static_cast<uint16_t>(used_width), shelf_y + shelf_height);
+    
+    for (const Placement& p : placements) {
+        const Bitmap1& image = images[p.index];
+        copy(image.view(),
+             collage.view()
+                 .rows(p.y, image.get_height())
+                 .columns(p.x / 8, image.get_width() / 8));
+    }
+    
+    return collage;
+}
+
+void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [OPTIONS] <image_file.jpg>...\n\n"
+              << "Print an image on the thermal printer with dithering.\n"
+              << "Supported formats: JPG, PNG, BMP, TGA, GIF\n\n"
+              << "Options:\n"
+              << "  -p, --profile NAME   Speed profile: quality, standard, draft\n"
+              << "                       (default: keep the printer's heating)\n"
+              << "  -R, --raster NAME    Raster command: gs-v0, esc-star, gs-l, or\n"
+              << "                       auto to benchmark them and use the fastest\n"
+              << "  -s, --stream         Continuous raster: one header, chunked transfers\n"
+              << "  -C, --collage        Pack several images side by side across the\n"
+              << "                       paper width instead of one per row\n"
+              << "  -m, --render MODE    auto (threshold text, dither photos), dither,\n"
+              << "                       or threshold (default: auto)\n"
+              << "  -b, --brightness N   Brightness, -100 to 100 (default: 0)\n"
+              << "  -c, --contrast N     Contrast, -100 to 100 (default: 0)\n"
+              << "  -g, --gamma G        Gamma (default: 2.2)\n"
+              << "  -S, --sharpen A      Unsharp mask amount, 0 to 10, e.g. 0.5 to 2\n"
+              << "                       (default: off)\n"
+              << "  -a, --auto-levels    Stretch the tonal range to full black and white\n"
+              << "  -i, --invert         White on black\n"
+              << "  -N, --native-invert  With --invert: the printer's GS B inverts\n"
+              << "                       images too, so let it do the inverting\n"
+              << "  -U, --upside-down    Print rotated 180 degrees\n"
+              << "  -B, --benchmark      Print the image once per speed profile\n"
+              << "                       and report lines/second for each\n"
+              << "  -E, --emulate FILE   Print on the built-in emulator instead of the\n"
+              << "                       printer, save the paper as a PNG FILE and\n"
+              << "                       report the expected print time\n"
+              << "  -O, --record FILE    Record all device traffic with timing to a\n"
+              << "                       capture FILE for print_replay\n"
+              << "  -h, --help           Show this help message\n";
+}
+
+void print_image(Printer& pos, ConstBitmap1View bitmap, bool stream) {
+    if (stream) {
+        pos.print_bitmap_stream(Printer::BitmapMode::NORMAL, bitmap);
+    } else {
+        pos.print_bitmap_lines(Printer::BitmapMode::NORMAL, bitmap);
+    }
+}
+
+// Print the bitmap and wait until the printer has finished it. On the
+// emulator the time is the one it expects the printer to take.
+double print_timed(Printer& pos, ConstBitmap1View bitmap, bool stream,
+                   const Emulator* emulator) {
+    if (emulator) {
+        double start = emulator->get_seconds();
+        print_image(pos, bitmap, stream);
+        pos.wait_idle();
+        return emulator->get_seconds() - start;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    print_image(pos, bitmap, stream);
+    pos.wait_idle();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <image_file.jpg>" << std::endl;
-        std::cerr << "Supported formats: JPG, PNG, BMP, TGA, GIF" << std::endl;
+    Printer::SpeedProfile profile = Printer::SpeedProfile::STANDARD;
+    bool set_profile = false; // else keep the printer's own heating
+    bool benchmark = false;
+    bool stream = false;
+    bool collage = false;
+    bool invert_image = false;
+    bool native_invert = false;
+    bool upside_down = false;
+    std::string raster = "gs-v0";
+    std::string emulate_png;
+    std::string record_file;
+    ToneOptions tone;
+    RenderMode render = RenderMode::AUTO;
+
+    static struct option long_options[] = {
+        {"profile",    required_argument, 0, 'p'},
+        {"raster",     required_argument, 0, 'R'},
+        {"stream",     no_argument,       0, 's'},
+        {"collage",    no_argument,       0, 'C'},
+        {"render",     required_argument, 0, 'm'},
+        {"brightness", required_argument, 0, 'b'},
+        {"contrast",   required_argument, 0, 'c'},
+        {"gamma",      required_argument, 0, 'g'},
+        {"sharpen",    required_argument, 0, 'S'},
+        {"auto-levels", no_argument,      0, 'a'},
+        {"invert",     no_argument,       0, 'i'},
+        {"native-invert", no_argument,    0, 'N'},
+        {"upside-down", no_argument,      0, 'U'},
+        {"benchmark",  no_argument,       0, 'B'},
+        {"emulate",    required_argument, 0, 'E'},
+        {"record",     required_argument, 0, 'O'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+
+    try {
+        while ((opt = getopt_long(argc, argv, "p:R:sCm:b:c:g:S:aiNUBE:O:h", long_options, &option_index)) != -1) {
+            switch (opt) {
+                case 'p':
+                    profile = Printer::speed_profile_from_name(optarg);
+                    set_profile = true;
+                    break;
+                case 'R':
+                    raster = optarg;
+                    if (raster != "auto") {
+                        raster_command_from_name(raster);
+                    }
+                    break;
+                case 's':
+                    stream = true;
+                    break;
+                case 'C':
+                    collage = true;
+                    break;
+                case 'm':
+                    if (std::string(optarg) == "auto") {
+                        render = RenderMode::AUTO;
+                    } else if (std::string(optarg) == "dither") {
+                        render = RenderMode::DITHER;
+                    } else if (std::string(optarg) == "threshold") {
+                        render = RenderMode::THRESHOLD;
+                    } else {
+                        throw std::runtime_error("Unknown render mode: " + std::string(optarg));
+                    }
+                    break;
+                case 'b':
+                    tone.brightness = std::stof(optarg);
+                    if (!(tone.brightness >= -100.0f && tone.brightness <= 100.0f)) {
+                        throw std::runtime_error("Brightness must be between -100 and 100");
+                    }
+                    break;
+                case 'c':
+                    tone.contrast = std::stof(optarg);
+                    if (!(tone.contrast >= -100.0f && tone.contrast <= 100.0f)) {
+                        throw std::runtime_error("Contrast must be between -100 and 100");
+                    }
+                    break;
+                case 'g':
+                    tone.gamma = std::stof(optarg);
+                    if (!(tone.gamma > 0.0f && std::isfinite(tone.gamma))) {
+                        throw std::runtime_error("Gamma must be positive and finite");
+                    }
+                    break;
+                case 'S':
+                    tone.sharpen = std::stof(optarg);
+                    if (!(tone.sharpen >= 0.0f && tone.sharpen <= 10.0f)) {
+                        throw std::runtime_error("Sharpen amount must be between 0 and 10");
+                    }
+                    break;
+                case 'a':
+                    tone.auto_levels = true;
+                    break;
+                case 'i':
+                    invert_image = true;
+                    break;
+                case 'N':
+                    native_invert = true;
+                    break;
+                case 'U':
+                    upside_down = true;
+                    break;
+                case 'B':
+                    benchmark = true;
+                    break;
+                case 'E':
+                    emulate_png = optarg;
+                    break;
+                case 'O':
+                    record_file = optarg;
+                    break;
+                case 'h':
+                    print_usage(argv[0]);
+                    return 0;
+                default:
+                    print_usage(argv[0]);
+                    return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (optind >= argc) {
+        print_usage(argv[0]);
         return 1;
     }
     
-    std::string filename = argv[1];
+    std::vector<std::string> filenames(argv + optind, argv + argc);
+    if (filenames.size() > 1 && !collage) {
+        std::cerr << "Error: several images need --collage" << std::endl;
+        return 1;
+    }
     
     try {
-        std::cout << "Loading and processing image: " << filename << std::endl;
-        
-        std::vector<uint8_t> bitmap;
-        int width, height;
-        
-        if (!load_and_process_image(filename, bitmap, width, height)) {
-            return 1;
-        }
-        
-        std::cout << "Final bitmap: " << width << "x" << height 
-                  << " (" << bitmap.size() << " bytes)" << std::endl;
-        
         std::cout << "Connecting to printer..." << std::endl;
+        // The transports go first, so they outlive the Printer
+        Emulator::Settings emulated;
+        emulated.raster_reverse = native_invert;
+        Emulator emulator(emulated);
+        std::unique_ptr<Transport> usb;
+        Transport* link = &emulator;
+        if (emulate_png.empty()) {
+            usb.reset(new UsbTransport());
+            link = usb.get();
+        }
+        // Tap the link to capture the job for print_replay
+        std::unique_ptr<RecordingTransport> recorder;
+        if (!record_file.empty()) {
+            recorder.reset(new RecordingTransport(*link, record_file));
+            link = recorder.get();
+        }
         Printer pos;
-        pos.open_usb();
+        pos.open(*link);
         pos.reset();
+
+        // Whether GS B covers rasters cannot be probed, only told
+        if (native_invert) {
+            Printer::DeviceProfile told = pos.get_device_profile();
+            told.raster_reverse = true;
+            pos.set_device_profile(told);
+        }
+
+        const Printer::DeviceProfile& device = pos.get_device_profile();
+        std::cout << "Printer: " << device.manufacturer << " " << device.model
+                  << " (" << device.print_width << " dots)" << std::endl;
+
+        std::vector<Bitmap1> images;
+        for (const std::string& filename : filenames) {
+            std::cout << "Loading and processing image: " << filename << std::endl;
+            
+            Bitmap1 image;
+            if (!load_and_process_image(filename, image, device.print_width,
+                                        tone, render)) {
+                return 1;
+            }
+            images.push_back(std::move(image));
+        }
         
-        std::cout << "Printing image..." << std::endl;
+        Bitmap1 bitmap = collage ? pack_collage(images, device.print_width)
+                                 : std::move(images[0]);
+        int width = bitmap.get_width();
+        int height = bitmap.get_height();
+        
+        std::cout << "Final bitmap: " << width << "x" << height 
+                  << " (" << bitmap.size() << " bytes)" << std::endl;
+
+        // Let the printer invert where GS B covers rasters. Blank rows
+        // print black then, so they cannot be skipped as paper feeds.
+        bool native_reverse = invert_image && device.raster_reverse;
+        if (native_reverse) {
+            pos.set_reverse(true);
+        } else if (invert_image) {
+            invert(bitmap.view());
+        }
+        if (upside_down) {
+            rotate180(bitmap.view());
+        }
+
+        // The emulator takes data as fast as it comes; pacing would only sleep
+        pos.set_pacing(emulate_png.empty());
+        pos.set_skip_blank_rows(!native_reverse);
         pos.set_alignment(Printer::Alignment::CENTER);
-        pos.print_bitmap_lines(Printer::BitmapMode::NORMAL, width, height, bitmap);
+
+        if (raster == "auto") {
+            std::cout << "Benchmarking raster commands..." << std::endl;
+            for (const Printer::RasterTiming& t : pos.benchmark_raster_commands(width)) {
+                std::cout << raster_command_name(t.command) << ": "
+                          << t.lines_per_second << " lines/s" << std::endl;
+            }
+            std::cout << "Using " << raster_command_name(pos.get_raster_command())
+                      << std::endl;
+        } else {
+            pos.set_raster_command(raster_command_from_name(raster));
+        }
+
+        if (benchmark) {
+            const Printer::SpeedProfile profiles[] = {
+                Printer::SpeedProfile::QUALITY,
+                Printer::SpeedProfile::STANDARD,
+                Printer::SpeedProfile::DRAFT
+            };
+
+            for (Printer::SpeedProfile p : profiles) {
+                pos.set_speed_profile(p);
+                pos.wait_idle();
+                double seconds = print_timed(pos, bitmap.view(), stream,
+                                             emulate_png.empty() ? nullptr : &emulator);
+                std::cout << Printer::speed_profile_name(p) << ": "
+                          << height / seconds << " lines/s ("
+                          << seconds << " s)" << std::endl;
+                pos.feed_lines(2);
+            }
+        } else {
+            if (set_profile) {
+                pos.set_speed_profile(profile);
+            }
+
+            std::cout << "Printing image..." << std::endl;
+            print_image(pos, bitmap.view(), stream);
+        }
         
         std::cout << "Feeding paper..." << std::endl;
-        pos.feed_lines(5);
-        pos.reset();
+        pos.write_bytes(cmd::feed_lines(5) + cmd::reset());
+
+        if (!emulate_png.empty()) {
+            emulator.finish();
+            ConstBitmap1View paper = emulator.get_paper();
+            write_png(emulate_png, paper);
+            std::cout << "Emulated " << paper.height / 8.0 << " mm of paper, expected print time "
+                      << emulator.get_seconds() << " s, saved to " << emulate_png << std::endl;
+        }
         
         std::cout << "Done!" << std::endl;
         return 0;
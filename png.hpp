@@ -0,0 +1,128 @@
+#ifndef EM5820_PNG_HPP
+#define EM5820_PNG_HPP
+
+#include "bitmap.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace em5820 {
+
+namespace detail {
+
+struct Crc32Table {
+  uint32_t entries[256];
+
+  Crc32Table() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      entries[n] = c;
+    }
+  }
+};
+
+inline const uint32_t *crc32_table() {
+  static const Crc32Table table;
+  return table.entries;
+}
+
+inline uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+  const uint32_t *table = crc32_table();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+inline void put_be32(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+inline void png_chunk(const char *type, const std::vector<uint8_t> &data,
+                      std::vector<uint8_t> &out) {
+  put_be32(out, static_cast<uint32_t>(data.size()));
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  put_be32(out, crc32(&out[start], out.size() - start));
+}
+
+} // namespace detail
+
+// Encode a bitmap as a 1-bit grayscale PNG. The image data goes into
+// stored (uncompressed) deflate blocks: no zlib needed, and at one bit per
+// dot a receipt is small anyway. PNG has no empty images, so a bitmap
+// without rows (a job that moved no paper) becomes one white row.
+inline void encode_png(ConstBitmap1View bitmap, std::vector<uint8_t> &out) {
+  if (bitmap.width == 0)
+    throw std::runtime_error("Cannot encode a bitmap without width as PNG");
+  uint32_t height = std::max<uint32_t>(bitmap.height, 1);
+
+  // Rows behind a filter type byte; PNG has 0 = black
+  size_t bytes = bitmap.bytes_per_line();
+  std::vector<uint8_t> raw;
+  raw.reserve((bytes + 1) * height);
+  for (uint32_t y = 0; y < bitmap.height; ++y) {
+    raw.push_back(0);
+    const uint8_t *row = bitmap.row(y);
+    for (size_t i = 0; i < bytes; ++i)
+      raw.push_back(static_cast<uint8_t>(~row[i]));
+  }
+  if (bitmap.height == 0) {
+    raw.push_back(0);
+    raw.insert(raw.end(), bytes, 0xff);
+  }
+
+  std::vector<uint8_t> zlib{0x78, 0x01};
+  zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+  size_t pos = 0;
+  do {
+    size_t n = std::min<size_t>(65535, raw.size() - pos);
+    zlib.push_back(pos + n == raw.size() ? 1 : 0); // BFINAL, BTYPE 00
+    zlib.push_back(static_cast<uint8_t>(n & 0xff));
+    zlib.push_back(static_cast<uint8_t>(n >> 8));
+    zlib.push_back(static_cast<uint8_t>(~n & 0xff));
+    zlib.push_back(static_cast<uint8_t>((~n >> 8) & 0xff));
+    zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + n);
+    pos += n;
+  } while (pos < raw.size());
+
+  uint32_t a = 1, b = 0;
+  for (uint8_t c : raw) {
+    a = (a + c) % 65521;
+    b = (b + a) % 65521;
+  }
+  detail::put_be32(zlib, b << 16 | a);
+
+  std::vector<uint8_t> header;
+  detail::put_be32(header, bitmap.width);
+  detail::put_be32(header, height);
+  const uint8_t format[5]{1, 0, 0, 0, 0}; // depth 1, gray, no interlace
+  header.insert(header.end(), format, format + sizeof(format));
+
+  const uint8_t signature[8]{0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  out.insert(out.end(), signature, signature + sizeof(signature));
+  detail::png_chunk("IHDR", header, out);
+  detail::png_chunk("IDAT", zlib, out);
+  detail::png_chunk("IEND", std::vector<uint8_t>(), out);
+}
+
+inline void write_png(const std::string &filename, ConstBitmap1View bitmap) {
+  std::vector<uint8_t> png;
+  encode_png(bitmap, png);
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.write(reinterpret_cast<const char *>(png.data()), png.size()))
+    throw std::runtime_error("Failed to write " + filename);
+}
+
+} // namespace em5820
+
+#endif // EM5820_PNG_HPP
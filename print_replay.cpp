@@ -0,0 +1,128 @@
+#include "capture.hpp"
+#include "emulator.hpp"
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <getopt.h>
+
+using namespace em5820;
+
+void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [OPTIONS] <capture_file>\n\n"
+              << "Replay a capture recorded with --record to the printer or the emulator.\n\n"
+              << "Options:\n"
+              << "  -f, --fast           Send as fast as possible instead of at the\n"
+              << "                       recorded pace\n"
+              << "  -E, --emulate FILE   Replay into the emulator, save the paper as a\n"
+              << "                       PNG FILE and report the expected print time\n"
+              << "  -l, --list           List the records instead of replaying them\n"
+              << "  -h, --help           Show this help message\n\n"
+              << "Examples:\n"
+              << "  sudo " << program_name << " slow-job.cap\n"
+              << "  " << program_name << " --fast --emulate paper.png slow-job.cap\n";
+}
+
+// One line per record: time, direction, size, and the first bytes
+void list_capture(std::istream& in) {
+    CaptureReader reader(in);
+    CaptureRecord record;
+    while (reader.next(record)) {
+        std::cout << std::fixed << std::setprecision(3) << std::setw(10)
+                  << record.time_us / 1000.0 << " ms  "
+                  << (record.direction == CaptureRecord::OUT ? "OUT " : "IN  ")
+                  << std::setw(6) << record.data.size() << " bytes ";
+        size_t shown = std::min<size_t>(record.data.size(), 12);
+        for (size_t i = 0; i < shown; ++i) {
+            std::cout << " " << std::hex << std::setw(2) << std::setfill('0')
+                      << static_cast<int>(record.data[i]) << std::dec << std::setfill(' ');
+        }
+        std::cout << (shown < record.data.size() ? " ..." : "") << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool paced = true;
+    bool list = false;
+    std::string emulate_png;
+
+    static struct option long_options[] = {
+        {"fast",    no_argument,       0, 'f'},
+        {"emulate", required_argument, 0, 'E'},
+        {"list",    no_argument,       0, 'l'},
+        {"help",    no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "fE:lh", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'f':
+                paced = false;
+                break;
+            case 'E':
+                emulate_png = optarg;
+                break;
+            case 'l':
+                list = true;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        std::ifstream capture(argv[optind], std::ios::binary);
+        if (!capture) {
+            throw std::runtime_error("Cannot open capture: " + std::string(argv[optind]));
+        }
+
+        if (list) {
+            list_capture(capture);
+            return 0;
+        }
+
+        // The capture holds the probe and every reset, so the raw
+        // transport is enough; no Printer in between
+        Emulator emulator;
+        std::unique_ptr<Transport> usb;
+        Transport* link = &emulator;
+        if (emulate_png.empty()) {
+            usb.reset(new UsbTransport());
+            link = usb.get();
+        }
+
+        ReplayStats stats = replay_capture(capture, *link, paced);
+        std::cout << "Replayed " << stats.out_transfers << " transfers ("
+                  << stats.out_bytes << " bytes) in " << stats.seconds
+                  << " s, recorded " << stats.recorded_seconds << " s" << std::endl;
+        std::cout << "Replies: " << stats.replies_received << " of "
+                  << stats.replies_expected << " received, "
+                  << stats.replies_differing << " differ from the capture" << std::endl;
+
+        if (!emulate_png.empty()) {
+            emulator.finish();
+            ConstBitmap1View paper = emulator.get_paper();
+            write_png(emulate_png, paper);
+            std::cout << "Emulated " << paper.height / 8.0 << " mm of paper, expected print time "
+                      << emulator.get_seconds() << " s, saved to " << emulate_png << std::endl;
+        }
+        return 0;
+
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
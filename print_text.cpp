@@ -1,7 +1,13 @@
+#include "capture.hpp"
+#include "emulator.hpp"
 #include "printer.hpp"
+#include "receipt_template.hpp"
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
+#include <vector>
 #include <getopt.h>
 
 using namespace em5820;
@@ -18,24 +24,71 @@ void print_usage(const char* program_name) {
               << "  -w, --wide           Double width text\n"
               << "  -t, --tall           Double height text\n"
               << "  -L, --large          Double width and height\n"
+              << "  -i, --invert         White on black\n"
+              << "  -U, --upside-down    Rotate 180 degrees, last line printed first\n"
+              << "  -R, --rotate         Rotate characters 90 degrees clockwise\n"
+              << "  -Q, --qr             Print the input as a QR code\n"
+              << "  -k, --barcode TYPE   Print the input as a barcode: upc-a, upc-e,\n"
+              << "                       ean13, ean8, code39, itf, codabar, code93,\n"
+              << "                       code128\n"
+              << "  -T, --template FILE  Read CSV from stdin and print one receipt per\n"
+              << "                       row from the template FILE\n"
               << "  -f, --feed N         Feed N lines after printing (default: 2)\n"
+              << "  -p, --profile NAME   Speed profile: quality, standard, draft\n"
+              << "                       (default: keep the printer's heating)\n"
+              << "  -E, --emulate FILE   Print on the built-in emulator instead of the\n"
+              << "                       printer, save the paper as a PNG FILE and\n"
+              << "                       report the expected print time\n"
+              << "  -x, --raw            Forward stdin unchanged as pre-encoded ESC/POS,\n"
+              << "                       as it arrives; no reset, formatting or feed\n"
+              << "  -O, --record FILE    Record all device traffic with timing to a\n"
+              << "                       capture FILE for print_replay\n"
               << "  -h, --help           Show this help message\n\n"
               << "Examples:\n"
               << "  echo 'Hello World' | " << program_name << "\n"
               << "  cat file.txt | " << program_name << " --center --bold\n"
               << "  ls -la | " << program_name << " --left\n"
               << "  fortune | " << program_name << " --center\n"
-              << "  date | " << program_name << " --bold --center\n";
+              << "  date | " << program_name << " --bold --center\n"
+              << "  cal | " << program_name << " --upside-down\n"
+              << "  echo https://example.com | " << program_name << " --qr --center\n"
+              << "  cat orders.csv | " << program_name << " --template receipt.txt\n"
+              << "  cat file.txt | " << program_name << " --emulate paper.png\n"
+              << "  cat job.bin | " << program_name << " --raw\n";
+}
+
+// Save what the emulator printed and say how long the printer would take
+void report_emulation(Emulator& emulator, const std::string& png) {
+    emulator.finish();
+    ConstBitmap1View paper = emulator.get_paper();
+    write_png(png, paper);
+    std::cerr << "Emulated " << paper.height / 8.0 << " mm of paper, expected print time "
+              << emulator.get_seconds() << " s, saved to " << png << std::endl;
 }
 
 int main(int argc, char* argv[]) {
+    // Buffer stdin in the stream, so in_avail() can tell when input runs dry
+    std::ios::sync_with_stdio(false);
+
     // Default options
     bool bold = false;
     bool underline = false;
     bool double_width = false;
     bool double_height = false;
+    bool invert = false;
+    bool upside_down = false;
+    bool rotate = false;
+    bool qr = false;
+    bool barcode = false;
+    Barcode barcode_type = Barcode::CODE128;
     Printer::Alignment alignment = Printer::Alignment::LEFT;
     int feed_lines = 2;
+    Printer::SpeedProfile profile = Printer::SpeedProfile::STANDARD;
+    bool set_profile = false; // else keep the printer's own heating
+    std::string template_file;
+    std::string emulate_png;
+    std::string record_file;
+    bool raw = false;
     
     // Parse command line options
     static struct option long_options[] = {
@@ -47,7 +100,17 @@ int main(int argc, char* argv[]) {
         {"wide",      no_argument,       0, 'w'},
         {"tall",      no_argument,       0, 't'},
         {"large",     no_argument,       0, 'L'},
+        {"invert",    no_argument,       0, 'i'},
+        {"upside-down", no_argument,     0, 'U'},
+        {"rotate",    no_argument,       0, 'R'},
+        {"qr",        no_argument,       0, 'Q'},
+        {"barcode",   required_argument, 0, 'k'},
+        {"template",  required_argument, 0, 'T'},
         {"feed",      required_argument, 0, 'f'},
+        {"profile",   required_argument, 0, 'p'},
+        {"emulate",   required_argument, 0, 'E'},
+        {"record",    required_argument, 0, 'O'},
+        {"raw",       no_argument,       0, 'x'},
         {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -55,7 +118,7 @@ int main(int argc, char* argv[]) {
     int opt;
     int option_index = 0;
     
-    while ((opt = getopt_long(argc, argv, "bulcrwtLf:h", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "bulcrwtLiURQk:T:f:p:E:O:xh", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'b':
                 bold = true;
@@ -82,9 +145,51 @@ int main(int argc, char* argv[]) {
                 double_width = true;
                 double_height = true;
                 break;
+            case 'i':
+                invert = true;
+                break;
+            case 'U':
+                upside_down = true;
+                break;
+            case 'R':
+                rotate = true;
+                break;
+            case 'Q':
+                qr = true;
+                break;
+            case 'k':
+                try {
+                    barcode_type = barcode_from_name(optarg);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    return 1;
+                }
+                barcode = true;
+                break;
+            case 'T':
+                template_file = optarg;
+                break;
             case 'f':
                 feed_lines = std::stoi(optarg);
                 break;
+            case 'p':
+                try {
+                    profile = Printer::speed_profile_from_name(optarg);
+                    set_profile = true;
+                } catch (const std::exception &e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    return 1;
+                }
+                break;
+            case 'E':
+                emulate_png = optarg;
+                break;
+            case 'O':
+                record_file = optarg;
+                break;
+            case 'x':
+                raw = true;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -95,10 +200,65 @@ int main(int argc, char* argv[]) {
     }
     
     try {
-        // Connect to printer
+        // Connect to printer. The transports go first, so they outlive it.
+        Emulator emulator;
+        std::unique_ptr<Transport> usb;
+        Transport* link = &emulator;
+        if (emulate_png.empty()) {
+            usb.reset(new UsbTransport());
+            link = usb.get();
+        }
+        // Tap the link to capture the job for print_replay
+        std::unique_ptr<RecordingTransport> recorder;
+        if (!record_file.empty()) {
+            recorder.reset(new RecordingTransport(*link, record_file));
+            link = recorder.get();
+        }
         Printer pos;
-        pos.open_usb();
+        pos.open(*link);
+
+        if (raw) {
+            // Pre-encoded jobs go out byte for byte, in one streaming pass
+            uint64_t sent = pos.write_raw(std::cin);
+            std::cerr << "Sent " << sent << " bytes" << std::endl;
+            if (!emulate_png.empty()) {
+                report_emulation(emulator, emulate_png);
+            }
+            return 0;
+        }
+
+        // Collect what is written and send it as optimized streams instead
+        // of one transfer per line
+        pos.hold();
         pos.reset();
+        if (set_profile) {
+            pos.set_speed_profile(profile);
+        }
+        
+        if (!template_file.empty()) {
+            // Mail merge: the template is compiled once, each CSV row only
+            // patches in its values
+            std::ifstream file(template_file);
+            if (!file) {
+                throw std::runtime_error("Cannot open template: " + template_file);
+            }
+            std::stringstream source;
+            source << file.rdbuf();
+            ReceiptTemplate receipt = ReceiptTemplate::compile(source.str());
+            
+            size_t count = receipt.merge_csv(std::cin, [&](const std::vector<uint8_t> &bytes) {
+                pos.write_bytes(bytes);
+                pos.feed_lines(feed_lines);
+                pos.flush();
+            });
+            std::cerr << "Printed " << count << " receipts" << std::endl;
+            pos.reset();
+            pos.release();
+            if (!emulate_png.empty()) {
+                report_emulation(emulator, emulate_png);
+            }
+            return 0;
+        }
         
         // Set alignment
         pos.set_alignment(alignment);
@@ -114,24 +274,60 @@ int main(int argc, char* argv[]) {
             pos.set_print_text_type(format);
         }
         
+        // Transforms are done by the printer, not by re-rendering
+        if (invert) pos.set_reverse(true);
+        if (upside_down) pos.set_upside_down(true);
+        if (rotate) pos.set_rotate_90(true);
+        
         // Read from stdin and print
         std::string line;
         bool first_line = true;
         
-        while (std::getline(std::cin, line)) {
-            if (!first_line) {
-                pos.write_string("\n");
+        if (qr || barcode) {
+            // The printer draws the code from its data
+            std::stringstream input;
+            input << std::cin.rdbuf();
+            std::string data = input.str();
+            while (!data.empty() && (data.back() == '\n' || data.back() == '\r')) {
+                data.pop_back();
+            }
+            if (qr) {
+                pos.print_qr(data);
+            } else {
+                pos.print_barcode(barcode_type, data);
+            }
+        } else if (upside_down) {
+            // ESC { turns each line over; reversing the line order turns
+            // the whole text over
+            std::vector<std::string> lines;
+            while (std::getline(std::cin, line)) {
+                lines.push_back(line);
+            }
+            for (auto it = lines.rbegin(); it != lines.rend(); ++it) {
+                pos.write_string(*it + "\n");
+                first_line = false;
+            }
+        } else {
+            while (std::getline(std::cin, line)) {
+                pos.write_string(line + "\n");
+                first_line = false;
+                // Send what is held once the input has nothing more ready,
+                // so live pipes print as lines arrive
+                if (std::cin.rdbuf()->in_avail() <= 0) {
+                    pos.flush();
+                }
             }
-            pos.write_string(line);
-            first_line = false;
         }
         
         // Add two empty lines at the end
-        pos.write_string("\n\n");
+        pos.write_string(first_line ? "\n\n" : "\n");
         
-        // Feed paper and reset
-        pos.feed_lines(feed_lines);
-        pos.reset();
+        // Feed paper and reset, in one transfer
+        pos.write_bytes(cmd::feed_lines(feed_lines) + cmd::reset());
+        pos.release();
+        if (!emulate_png.empty()) {
+            report_emulation(emulator, emulate_png);
+        }
         
         return 0;
         
@@ -0,0 +1,128 @@
+#ifndef EM5820_PRINT_TIME_HPP
+#define EM5820_PRINT_TIME_HPP
+
+#include "printer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace em5820 {
+
+// Timing-relevant content of a print job
+struct JobProfile {
+  uint64_t raster_lines = 0;   // dot lines of raster images
+  uint64_t excess_us = 0;      // strobing beyond the paper step
+  uint64_t feed_dots = 0;      // paper fed without printing
+  uint64_t text_lines = 0;     // printed lines of text
+
+  // Count the lines of a packed bitmap and the time dense lines add: they
+  // need more strobes than fit into the paper step and slow the mechanism
+  // down, by as much as the pacing HeatModel predicts
+  void add_raster(ConstBitmap1View bitmap,
+                  const Printer::HeatModel &heat = Printer::HeatModel()) {
+    for (uint32_t y = 0; y < bitmap.height; ++y) {
+      uint64_t dots = count_black_dots(bitmap.row(y), bitmap.bytes_per_line());
+      excess_us += heat.line_time_us(dots) - heat.line_us;
+    }
+    raster_lines += bitmap.height;
+  }
+
+  void add_raster(const uint8_t *bitmap, uint16_t width, uint32_t height,
+                  const Printer::HeatModel &heat = Printer::HeatModel()) {
+    add_raster(ConstBitmap1View(bitmap, width, height), heat);
+  }
+
+  void add_feed_dots(uint32_t dots) { feed_dots += dots; }
+
+  // ESC d feeds whole lines at the default 30-dot line spacing
+  void add_feed_lines(uint32_t lines) { feed_dots += lines * 30ULL; }
+
+  void add_text_lines(uint64_t lines) { text_lines += lines; }
+};
+
+// Linear print-time model. The defaults follow Printer::HeatModel; fit them
+// to measured runs of a given device with calibrate().
+struct PrintTimeModel {
+  double job_s = 0.5;          // fixed cost per job (reset, wake-up)
+  double line_s = 0.002;       // per raster dot line
+  double excess_s = 1e-6;      // per microsecond of excess strobing
+  double feed_dot_s = 0.002;   // per dot of paper feed
+  double text_line_s = 0.06;   // per line of 24-dot text with spacing
+
+  double estimate(const JobProfile &job) const {
+    return job_s + line_s * job.raster_lines + excess_s * job.excess_us +
+           feed_dot_s * job.feed_dots + text_line_s * job.text_lines;
+  }
+};
+
+// A job whose print time was measured on a real device
+struct TimedJob {
+  JobProfile job;
+  double seconds;
+};
+
+// Least-squares fit of the model to measured runs. Coefficients the runs
+// say nothing about (e.g. no text in any run) keep the value from prior.
+inline PrintTimeModel calibrate(const std::vector<TimedJob> &runs,
+                                const PrintTimeModel &prior = PrintTimeModel()) {
+  const int N = 5;
+  double x0[N] = {prior.job_s, prior.line_s, prior.excess_s, prior.feed_dot_s,
+                  prior.text_line_s};
+  double ata[N][N + 1] = {};
+
+  for (const TimedJob &run : runs) {
+    double f[N] = {1.0, static_cast<double>(run.job.raster_lines),
+                   static_cast<double>(run.job.excess_us),
+                   static_cast<double>(run.job.feed_dots),
+                   static_cast<double>(run.job.text_lines)};
+    for (int i = 0; i < N; ++i) {
+      for (int j = 0; j < N; ++j)
+        ata[i][j] += f[i] * f[j];
+      ata[i][N] += f[i] * run.seconds;
+    }
+  }
+
+  // Ridge term pulling each coefficient towards the prior
+  for (int i = 0; i < N; ++i) {
+    double lambda = 1e-6 * ata[i][i] + 1e-12;
+    ata[i][i] += lambda;
+    ata[i][N] += lambda * x0[i];
+  }
+
+  // Gaussian elimination with partial pivoting
+  for (int col = 0; col < N; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < N; ++row)
+      if (std::fabs(ata[row][col]) > std::fabs(ata[pivot][col]))
+        pivot = row;
+    for (int k = 0; k <= N; ++k)
+      std::swap(ata[col][k], ata[pivot][k]);
+
+    for (int row = col + 1; row < N; ++row) {
+      double factor = ata[row][col] / ata[col][col];
+      for (int k = col; k <= N; ++k)
+        ata[row][k] -= factor * ata[col][k];
+    }
+  }
+
+  double x[N];
+  for (int row = N - 1; row >= 0; --row) {
+    double sum = ata[row][N];
+    for (int k = row + 1; k < N; ++k)
+      sum -= ata[row][k] * x[k];
+    x[row] = sum / ata[row][row];
+  }
+
+  PrintTimeModel model;
+  model.job_s = x[0];
+  model.line_s = x[1];
+  model.excess_s = x[2];
+  model.feed_dot_s = x[3];
+  model.text_line_s = x[4];
+  return model;
+}
+
+} // namespace em5820
+
+#endif // EM5820_PRINT_TIME_HPP
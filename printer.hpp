@@ -1,8 +1,22 @@
 #ifndef EM5820_HPP
 #define EM5820_HPP
 
-#include <libusb-1.0/libusb.h>
+#include "barcode.hpp"
+#include "commands.hpp"
+#include "raster.hpp"
+#include "stream_optimizer.hpp"
+#include "transport.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <vector>
 #include <unistd.h>  // for usleep
 
@@ -12,191 +26,616 @@ class Printer {
 public:
   enum class Alignment { LEFT, CENTER, RIGHT };
   enum class BitmapMode { NORMAL, WIDE, TALL, HUGE };
+  enum class SpeedProfile { QUALITY, STANDARD, DRAFT };
+
+  // Fills one packed raster row (width / 8 bytes); returns false when done
+  using RowSource = std::function<bool(uint8_t *row)>;
+
+  // Renders rows [first_line, first_line + count) into dst, packed row-major
+  using BandSource =
+      std::function<void(uint32_t first_line, uint16_t count, uint8_t *dst)>;
+
+  // Timing model of the print mechanism, used to pace raster transfers.
+  // The head fires at most dots_per_strobe dots at once, so dense lines take
+  // several strobes while blank lines only cost a paper step.
+  struct HeatModel {
+    uint32_t line_us = 2000;       // paper step per dot line (~60 mm/s)
+    uint32_t strobe_us = 820;      // heating time + interval per strobe
+    uint16_t dots_per_strobe = 64; // dots heated at once (ESC 7 n1)
+    uint32_t buffer_bytes = 4096;  // receive buffer of the printer
+    uint32_t lead_us = 250000;     // printing kept queued ahead of the head
+    uint32_t segment_us = 100000;  // target burn time per GS v 0 segment
+
+    uint32_t line_time_us(uint64_t black_dots) const {
+      uint64_t strobes = (black_dots + dots_per_strobe - 1) / dots_per_strobe;
+      return static_cast<uint32_t>(
+          std::max<uint64_t>(line_us, strobes * strobe_us));
+    }
+  };
+
+  // Measured throughput of one raster command
+  struct RasterTiming {
+    RasterCommand command;
+    double lines_per_second;
+  };
+
+  // What is known about the attached printer. Filled in by open_usb() or
+  // open() from the USB descriptors and the GS I replies; fast paths check
+  // it before using commands the firmware may not have. Only the identity
+  // fields are read from the printer. ESC/POS has no query for the rest,
+  // so they are EM5820 defaults or inferred, as noted; correct them with
+  // set_device_profile().
+  struct DeviceProfile {
+    std::string manufacturer;
+    std::string model;
+    std::string firmware;
+    uint8_t model_id = 0;        // GS I 1
+    uint8_t type_id = 0;         // GS I 2
+    bool responds_to_gs_i = false;
+    // Dots per line. 576 when the model name reads like an 80 mm printer.
+    uint16_t print_width = 384;
+    uint32_t buffer_bytes = 4096; // default, not probed
+    // GS ( L is assumed for printers answering the extended GS I queries
+    uint8_t raster_commands = (1 << static_cast<int>(RasterCommand::GS_V_0)) |
+                              (1 << static_cast<int>(RasterCommand::ESC_STAR));
+    // ESC t code pages, default and not probed: PC437, Katakana, PC850,
+    // PC860, PC863, PC865, WPC1252, PC866, PC852, PC858
+    std::vector<uint8_t> code_pages{0, 1, 2, 3, 4, 5, 16, 17, 18, 19};
+    // GS B also inverts raster images, not just characters. Not probed,
+    // as few firmwares do; set it for those that do, as print_image
+    // --native-invert does.
+    bool raster_reverse = false;
+
+    bool supports(RasterCommand command) const {
+      return raster_commands & (1 << static_cast<int>(command));
+    }
+  };
 
   Printer() = default;
 
-  ~Printer() {
-    if (dev_handle) {
-      libusb_release_interface(dev_handle, 0);
-      libusb_close(dev_handle);
-      dev_handle = nullptr;
-    }
+  // Open the EM5820 on USB
+  void open_usb(bool probe = true) {
+    cleanup();
+    owned_transport.reset(new UsbTransport());
+    attach(*owned_transport, probe);
+  }
 
-    if (ctx) {
-      libusb_exit(ctx);
-      ctx = nullptr;
-    }
+  // Talk through any transport, e.g. an Emulator. It must outlive the
+  // Printer or the next open() / cleanup().
+  void open(Transport &channel, bool probe = true) {
+    cleanup();
+    attach(channel, probe);
   }
 
-  void open_usb() {
-    if (libusb_init(&ctx) < 0) {
-      ctx = nullptr;
-      throw std::runtime_error("Failed to initialize libusb");
-    }
+  const DeviceProfile &get_device_profile() const { return profile; }
+
+  // Override what was probed, e.g. for clones that do not answer GS I
+  void set_device_profile(const DeviceProfile &device) {
+    profile = device;
+    heat.buffer_bytes = profile.buffer_bytes;
+    if (!profile.supports(raster_command))
+      raster_command = RasterCommand::GS_V_0;
+  }
+
+  size_t write_bytes(const std::vector<uint8_t> &data) {
+    return write_bytes(data.data(), data.size());
+  }
 
-    libusb_device **dev_list = nullptr;
-    ssize_t count = libusb_get_device_list(ctx, &dev_list);
-    if (count < 0) {
-      libusb_exit(ctx);
-      ctx = nullptr;
-      throw std::runtime_error("Failed to get USB device list");
+  // Commands built at compile time, see commands.hpp
+  template <size_t N> size_t write_bytes(const Command<N> &command) {
+    return write_bytes(command.data(), N);
+  }
+
+  template <size_t N> size_t write_bytes(const std::array<uint8_t, N> &data) {
+    return write_bytes(data.data(), N);
+  }
+
+  size_t write_bytes(const uint8_t *data, size_t size) {
+    if (holding) {
+      held.insert(held.end(), data, data + size);
+      return size;
     }
+    return send_now(data, size);
+  }
 
-    libusb_device_descriptor desc;
-    libusb_device *target_device = nullptr;
-    for (ssize_t i = 0; i < count; ++i) {
-      libusb_device *device = dev_list[i];
-      libusb_get_device_descriptor(device, &desc);
-      if (desc.idVendor == USB_VENDOR && desc.idProduct == USB_PRODUCT) {
-        target_device = device;
+  // Collect what is written from now on instead of sending it. flush()
+  // runs the collected stream through optimize_stream() and sends it.
+  void hold() { holding = true; }
+
+  // Send what was held, optimized, in packet-sized bulk transfers; holding
+  // stays on. Returns the bytes sent.
+  size_t flush(StreamStats *stats = nullptr) {
+    std::vector<uint8_t> stream;
+    stream.swap(held);
+    if (stream.empty())
+      return 0;
+
+    std::vector<uint8_t> optimized;
+    StreamStats s = optimize_stream(stream.data(), stream.size(), optimized);
+    if (stats)
+      *stats = s;
+
+    // One drain for the whole stream, not one per chunk
+    drain_replies();
+    size_t chunk_bytes = stream_chunk_bytes(64);
+    for (size_t offset = 0; offset < optimized.size(); offset += chunk_bytes)
+      transfer_out(optimized.data() + offset,
+                   std::min(chunk_bytes, optimized.size() - offset));
+    return optimized.size();
+  }
+
+  // Flush and send directly again
+  size_t release() {
+    size_t sent = flush();
+    holding = false;
+    return sent;
+  }
+
+  bool is_holding() const { return holding; }
+
+  // Forward an encoded ESC/POS stream as is, in packet-aligned chunks,
+  // without draining replies or pacing in between. Input is taken as it
+  // becomes available, up to block_bytes at a time; when it runs dry the
+  // partial chunk goes out too, so live producers print as they write.
+  // Anything held is flushed first; the stream itself is never held or
+  // optimized. Returns the bytes sent.
+  uint64_t write_raw(std::istream &in, size_t block_bytes = 65536,
+                     size_t chunk_packets = 64) {
+    size_t chunk_bytes = stream_chunk_bytes(chunk_packets);
+    block_bytes = std::max(block_bytes, chunk_bytes);
+    // Room for a block behind the partial chunk left from the one before
+    std::vector<uint8_t> block(block_bytes + chunk_bytes);
+    size_t carry = 0;
+    uint64_t sent = 0;
+
+    flush();
+    for (;;) {
+      // Wait for input only while nothing is held back
+      if (carry == 0 && in.peek() == std::char_traits<char>::eof())
         break;
+
+      char *dst = reinterpret_cast<char *>(block.data() + carry);
+      std::streamsize n;
+      if (carry == 0 && in.rdbuf()->in_avail() <= 0) {
+        // The stream cannot tell what is ready; wait for a full block
+        in.read(dst, static_cast<std::streamsize>(block_bytes));
+        n = in.gcount();
+      } else {
+        n = in.readsome(dst, static_cast<std::streamsize>(block_bytes));
       }
-    }
 
-    if (!target_device) {
-      libusb_free_device_list(dev_list, 1);
-      libusb_exit(ctx);
-      ctx = nullptr;
-      throw std::runtime_error("Target USB device not found");
+      size_t size = carry + static_cast<size_t>(n);
+      size_t ready = n > 0 ? size - size % chunk_bytes : size;
+      for (size_t offset = 0; offset < ready; offset += chunk_bytes)
+        transfer_out(block.data() + offset,
+                     std::min(chunk_bytes, ready - offset));
+      carry = size - ready;
+      std::memmove(block.data(), block.data() + ready, carry);
+      sent += ready;
     }
+    return sent;
+  }
 
-    if (libusb_open(target_device, &dev_handle) < 0) {
-      libusb_free_device_list(dev_list, 1);
-      libusb_exit(ctx);
-      ctx = nullptr;
-      throw std::runtime_error("Failed to open USB device");
-    }
+  // Print bitmap in batches of lines (much faster!)
+  uint64_t print_bitmap_lines(BitmapMode mode, uint16_t width, uint32_t height,
+                              const std::vector<uint8_t> &bitmap,
+                              uint16_t lines_per_batch = 50) {
+      size_t bytes_per_line = raster_bytes_per_line(width, lines_per_batch);
+      if (bitmap.size() < bytes_per_line * height) {
+          throw std::runtime_error("Bitmap is smaller than width x height");
+      }
+      return print_bitmap_lines(
+          mode, ConstBitmap1View(bitmap.data(), width, height),
+          lines_per_batch);
+  }
 
-    libusb_free_device_list(dev_list, 1);
+  // Print a bitmap view. Contiguous views are sent in place; strided ones
+  // (a crop of a wider bitmap) are gathered one batch at a time.
+  uint64_t print_bitmap_lines(BitmapMode mode, ConstBitmap1View bitmap,
+                              uint16_t lines_per_batch = 50) {
+      size_t bytes_per_line =
+          raster_bytes_per_line(bitmap.width, lines_per_batch);
+      uint32_t height = bitmap.height;
+
+      if (!bitmap.contiguous()) {
+          return print_bitmap_lines(
+              mode, bitmap.width, height,
+              [&](uint32_t first, uint16_t count, uint8_t *dst) {
+                  copy(bitmap.rows(first, count),
+                       Bitmap1View(dst, bitmap.width, count));
+              },
+              lines_per_batch);
+      }
 
-    if (libusb_kernel_driver_active(dev_handle, 0)) {
-      int ret = libusb_detach_kernel_driver(dev_handle, 0);
-      if (ret != 0) {
-        cleanup();
-        throw std::runtime_error("Failed to detach kernel driver: " +
-                                 std::string(libusb_error_name(ret)));
+      // With pacing the batches are sized by burn time instead
+      if (pacing) {
+          lines_per_batch = UINT16_MAX;
       }
-    }
+      lines_per_batch = whole_bands(mode, lines_per_batch);
+
+      uint64_t total_sent = 0;
+      uint32_t current_line = 0;
+
+      while (current_line < height) {
+          uint16_t batch_size = static_cast<uint16_t>(
+              std::min<uint32_t>(lines_per_batch, height - current_line));
+
+          if (skip_blank_rows) {
+              uint32_t blank = blank_rows(bitmap.data, bytes_per_line,
+                                          current_line, height);
+              if (blank >= BLANK_RUN) {
+                  total_sent += feed_blank_rows(blank * row_height(mode));
+                  current_line += blank;
+                  continue;
+              }
+              uint16_t rows = rows_before_blank_run(bitmap.data, bytes_per_line,
+                                                    current_line, batch_size);
+              // Run on into the blank rows to the end of the band
+              uint16_t step = band_rows(mode);
+              if (rows < batch_size && rows % step) {
+                  rows += step - rows % step;
+              }
+              batch_size = rows;
+          }
+
+          total_sent += send_raster_segment(mode, bytes_per_line,
+                                            bitmap.row(current_line),
+                                            batch_size);
 
-    int ret = libusb_claim_interface(dev_handle, 0);
-    if (ret < 0) {
-      cleanup();
-      throw std::runtime_error("Failed to claim interface: " +
-                               std::string(libusb_error_name(ret)));
-    }
+          current_line += batch_size;
+      }
+
+      return total_sent;
   }
 
-  uint16_t write_bytes(const std::vector<uint8_t> &data) {
-    int ret, transferred;
-    unsigned char buffer[64];
-    do {
-      ret = libusb_bulk_transfer(dev_handle, BULK_ENDPOINT_IN, buffer,
-                                 sizeof(buffer), &transferred, 100);
-    } while (ret == 0 && transferred > 0);
+  // Print a bitmap rendered on demand. Each batch is pulled from render_band
+  // just before it is sent, so the whole image never has to be in memory.
+  uint64_t print_bitmap_lines(BitmapMode mode, uint16_t width, uint32_t height,
+                              const BandSource &render_band,
+                              uint16_t lines_per_batch = 50) {
+      size_t bytes_per_line = raster_bytes_per_line(width, lines_per_batch);
+      lines_per_batch = whole_bands(mode, lines_per_batch);
+      std::vector<uint8_t> band(bytes_per_line *
+                                std::min<uint32_t>(lines_per_batch, height));
+
+      uint64_t total_sent = 0;
+      uint32_t current_line = 0;
+
+      while (current_line < height) {
+          uint16_t batch_size = static_cast<uint16_t>(
+              std::min<uint32_t>(lines_per_batch, height - current_line));
 
-    ret = libusb_bulk_transfer(dev_handle, BULK_ENDPOINT_OUT,
-                               const_cast<unsigned char *>(data.data()),
-                               data.size(), &transferred, TIMEOUT);
-    if (ret != 0 || transferred != data.size())
-      throw std::runtime_error("Failed transfer data: " +
-                               std::string(libusb_error_name(ret)));
+          render_band(current_line, batch_size, band.data());
+          total_sent += send_raster_segment(mode, bytes_per_line, band.data(),
+                                            batch_size);
 
-    return transferred;
+          current_line += batch_size;
+      }
+
+      return total_sent;
   }
 
-  // Print bitmap in batches of lines (much faster!)
-  uint16_t print_bitmap_lines(BitmapMode mode, uint16_t width, uint16_t height,
-                               const std::vector<uint8_t> &bitmap, 
-                               uint16_t lines_per_batch = 50) {
-      if (width % 8 != 0) {
-          throw std::runtime_error("Width must be multiple of 8");
+  // Continuous raster mode: one GS v 0 header per 65535 rows, with the
+  // payload streamed in bulk chunks of chunk_packets whole USB packets.
+  // Avoids the pause and banding seam some firmwares show at every header.
+  uint64_t print_bitmap_stream(BitmapMode mode, uint16_t width, uint32_t height,
+                               const std::vector<uint8_t> &bitmap,
+                               size_t chunk_packets = 64) {
+      size_t bytes_per_line = raster_bytes_per_line(width, 1);
+      if (bitmap.size() < bytes_per_line * height) {
+          throw std::runtime_error("Bitmap is smaller than width x height");
       }
-      
-      size_t bytes_per_line = width / 8;
-      uint16_t total_sent = 0;
-      uint16_t lines_remaining = height;
-      uint16_t current_line = 0;
-      
-      while (lines_remaining > 0) {
-          // Determine batch size
-          uint16_t batch_size = std::min(lines_per_batch, lines_remaining);
-          
-          // Send command for this batch
-          uint8_t width_first = bytes_per_line & 0x00ff;
-          uint8_t width_second = (bytes_per_line >> 8) & 0x00ff;
-          uint8_t height_first = batch_size & 0x00ff;
-          uint8_t height_second = (batch_size >> 8) & 0x00ff;
-          
-          std::vector<uint8_t> cmd{
-              0x1d, 0x76, 0x30, static_cast<uint8_t>(mode),
-              width_first, width_second, height_first, height_second
-          };
-          
-          total_sent += write_bytes(cmd);
-          
-          // Send batch of lines
-          size_t batch_bytes = batch_size * bytes_per_line;
-          std::vector<uint8_t> batch_data(
-              bitmap.begin() + (current_line * bytes_per_line),
-              bitmap.begin() + (current_line * bytes_per_line) + batch_bytes
-          );
-          
-          total_sent += write_bytes(batch_data);
-          
-          current_line += batch_size;
-          lines_remaining -= batch_size;
+      return print_bitmap_stream(
+          mode, ConstBitmap1View(bitmap.data(), width, height), chunk_packets);
+  }
+
+  // Continuous raster mode for a bitmap view; strided views are gathered
+  // through the band path
+  uint64_t print_bitmap_stream(BitmapMode mode, ConstBitmap1View bitmap,
+                               size_t chunk_packets = 64) {
+      size_t bytes_per_line = raster_bytes_per_line(bitmap.width, 1);
+      uint32_t height = bitmap.height;
+
+      if (!bitmap.contiguous()) {
+          return print_bitmap_stream(
+              mode, bitmap.width, height,
+              [&](uint32_t first, uint16_t count, uint8_t *dst) {
+                  copy(bitmap.rows(first, count),
+                       Bitmap1View(dst, bitmap.width, count));
+              },
+              50, chunk_packets);
+      }
+
+      size_t chunk_bytes = stream_chunk_bytes(chunk_packets);
+      uint64_t total_sent = 0;
+      uint32_t current_line = 0;
+
+      while (current_line < height) {
+          uint16_t rows = static_cast<uint16_t>(
+              std::min<uint32_t>(UINT16_MAX, height - current_line));
+
+          total_sent += send_raster_header(mode, bytes_per_line, rows);
+          total_sent += send_chunks(bitmap.row(current_line),
+                                    rows * bytes_per_line, bytes_per_line,
+                                    chunk_bytes, true);
+
+          current_line += rows;
+      }
+
+      return total_sent;
+  }
+
+  // Continuous raster mode for bitmaps rendered on demand
+  uint64_t print_bitmap_stream(BitmapMode mode, uint16_t width, uint32_t height,
+                               const BandSource &render_band,
+                               uint16_t lines_per_batch = 50,
+                               size_t chunk_packets = 64) {
+      size_t bytes_per_line = raster_bytes_per_line(width, lines_per_batch);
+      size_t chunk_bytes = stream_chunk_bytes(chunk_packets);
+      std::vector<uint8_t> staging;
+      staging.reserve(chunk_bytes + lines_per_batch * bytes_per_line);
+
+      uint64_t total_sent = 0;
+      uint32_t current_line = 0;
+
+      while (current_line < height) {
+          uint32_t block_rows =
+              std::min<uint32_t>(UINT16_MAX, height - current_line);
+          uint32_t block_end = current_line + block_rows;
+
+          total_sent += send_raster_header(
+              mode, bytes_per_line, static_cast<uint16_t>(block_rows));
+
+          while (current_line < block_end) {
+              uint16_t batch_size = static_cast<uint16_t>(std::min<uint32_t>(
+                  lines_per_batch, block_end - current_line));
+
+              size_t used = staging.size();
+              staging.resize(used + batch_size * bytes_per_line);
+              render_band(current_line, batch_size, staging.data() + used);
+              current_line += batch_size;
+
+              // Send whole chunks, keep the tail for the next band
+              size_t sent = send_chunks(staging.data(), staging.size(),
+                                        bytes_per_line, chunk_bytes,
+                                        current_line == block_end);
+              staging.erase(staging.begin(), staging.begin() + sent);
+              total_sent += sent;
+          }
+      }
+
+      return total_sent;
+  }
+
+  // Print a raster of any length (paper-roll banners). Rows are pulled from
+  // next_row one segment at a time, so memory use stays constant and each
+  // GS v 0 segment stays within the 16-bit height limit.
+  uint64_t print_banner(BitmapMode mode, uint16_t width,
+                        const RowSource &next_row,
+                        uint16_t lines_per_segment = 50) {
+      size_t bytes_per_line = raster_bytes_per_line(width, lines_per_segment);
+      lines_per_segment = whole_bands(mode, lines_per_segment);
+      std::vector<uint8_t> segment(bytes_per_line * lines_per_segment);
+
+      uint64_t total_sent = 0;
+      bool more = true;
+
+      while (more) {
+          uint16_t rows = 0;
+          while (rows < lines_per_segment &&
+                 (more = next_row(&segment[rows * bytes_per_line]))) {
+              ++rows;
+          }
+
+          if (rows > 0) {
+              total_sent += send_raster_segment(mode, bytes_per_line,
+                                                segment.data(), rows);
+          }
       }
-      
+
       return total_sent;
   }
 
-  uint16_t reset() { return write_bytes({0x1b, 0x40}); }
+  // Replace long runs of blank rows (e.g. transparent image areas) with
+  // paper feeds instead of sending them as raster data
+  void set_skip_blank_rows(bool enabled) { skip_blank_rows = enabled; }
+
+  // Command used for NORMAL-mode bitmaps; scaled modes always use GS v 0.
+  // Continuous raster mode (print_bitmap_stream) is GS v 0 only.
+  void set_raster_command(RasterCommand command) {
+    if (!profile.supports(command))
+      throw std::runtime_error(std::string("Raster command not supported: ") +
+                               raster_command_name(command));
+    raster_command = command;
+  }
+
+  RasterCommand get_raster_command() const { return raster_command; }
+
+  // Print a test band with each raster command, time it up to wait_idle()
+  // and keep the fastest one for all later bitmaps
+  std::vector<RasterTiming> benchmark_raster_commands(uint16_t width = 384,
+                                                      uint16_t rows = 96) {
+    size_t bytes_per_line = raster_bytes_per_line(width, rows);
+    std::vector<uint8_t> pattern(bytes_per_line * rows);
+    for (uint16_t y = 0; y < rows; ++y)
+      std::fill(pattern.begin() + y * bytes_per_line,
+                pattern.begin() + (y + 1) * bytes_per_line,
+                y % 2 ? 0xaa : 0x55);
+
+    const RasterCommand commands[] = {RasterCommand::GS_V_0,
+                                      RasterCommand::ESC_STAR,
+                                      RasterCommand::GS_L};
+    std::vector<RasterTiming> timings;
+    RasterTiming best{RasterCommand::GS_V_0, 0.0};
+
+    for (RasterCommand command : commands) {
+      if (!profile.supports(command))
+        continue;
+
+      raster_command = command;
+      wait_idle();
+
+      auto start = std::chrono::steady_clock::now();
+      send_raster_block(BitmapMode::NORMAL, bytes_per_line, pattern.data(),
+                        rows);
+      wait_idle();
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+
+      RasterTiming timing{command, rows / elapsed.count()};
+      timings.push_back(timing);
+      if (timing.lines_per_second > best.lines_per_second)
+        best = timing;
+    }
+
+    raster_command = best.command;
+    return timings;
+  }
+
+  // Pace raster transfers to the predicted print speed of each band, so dark
+  // images never stall the bulk transfer and light ones never starve the head
+  void set_pacing(bool enabled) { pacing = enabled; }
+
+  void set_heat_model(const HeatModel &model) { heat = model; }
+
+  const HeatModel &get_heat_model() const { return heat; }
+
+  // ESC 7: heat (dots + 1) * 8 dots at once, for time * 10 us, then pause
+  // interval * 10 us. Also updates the heat model used for pacing.
+  uint16_t set_heating(uint8_t dots, uint8_t time, uint8_t interval) {
+    heat.dots_per_strobe = (dots + 1) * 8;
+    heat.strobe_us = (time + interval) * 10;
+    return write_bytes(cmd::heating(dots, time, interval));
+  }
+
+  uint16_t set_speed_profile(SpeedProfile profile) {
+    switch (profile) {
+    case SpeedProfile::QUALITY:
+      return set_heating(7, 120, 4);
+    case SpeedProfile::DRAFT:
+      return set_heating(11, 50, 2);
+    case SpeedProfile::STANDARD:
+    default:
+      return set_heating(7, 80, 2); // common ESC 7 values
+    }
+  }
+
+  static SpeedProfile speed_profile_from_name(const std::string &name) {
+    if (name == "quality")
+      return SpeedProfile::QUALITY;
+    if (name == "standard")
+      return SpeedProfile::STANDARD;
+    if (name == "draft")
+      return SpeedProfile::DRAFT;
+    throw std::runtime_error("Unknown speed profile: " + name);
+  }
+
+  static const char *speed_profile_name(SpeedProfile profile) {
+    switch (profile) {
+    case SpeedProfile::QUALITY:
+      return "quality";
+    case SpeedProfile::DRAFT:
+      return "draft";
+    case SpeedProfile::STANDARD:
+    default:
+      return "standard";
+    }
+  }
+
+  // Block until the printer has worked through everything sent so far.
+  // GS r is answered in order, i.e. after the preceding data has printed.
+  void wait_idle(unsigned int timeout_ms = TIMEOUT) {
+    flush();
+    Command<3> status = cmd::paper_status();
+    send_now(status.data(), status.size());
+
+    uint8_t buffer[64];
+    if (link().read(buffer, sizeof(buffer), timeout_ms) == 0)
+      throw std::runtime_error("No status reply");
+
+    busy_until = std::chrono::steady_clock::now();
+  }
+
+  uint16_t reset() { return write_bytes(cmd::reset()); }
 
   uint16_t set_text_scale(uint8_t horizontal, uint8_t vertical) {
     uint8_t scale = vertical & 0xf | ((horizontal & 0xf) << 4);
-    return write_bytes({0x1d, 0x21, scale});
+    return write_bytes(cmd::text_size(scale));
   }
 
   uint16_t set_print_text_type(uint8_t print_type) {
-    return write_bytes({0x1b, 0x21, print_type});
+    return write_bytes(cmd::print_mode(print_type));
   }
 
   uint16_t write_string(const std::string &str) {
     return write_bytes(std::vector<uint8_t>(str.begin(), str.end()));
   }
 
-  uint16_t feed_dots(uint8_t dots) { return write_bytes({0x1b, 0x4a, dots}); }
+  uint16_t feed_dots(uint8_t dots) { return write_bytes(cmd::feed_dots(dots)); }
 
   uint16_t feed_lines(uint8_t lines) {
-    return write_bytes({0x1b, 0x64, lines});
+    return write_bytes(cmd::feed_lines(lines));
   }
 
   uint16_t set_horizontal_absolute_print_position(uint16_t pos) {
-    return write_bytes({0x1b, 0x24, static_cast<uint8_t>(pos),
-                        static_cast<uint8_t>(pos >> 8)});
+    return write_bytes(cmd::position(pos));
   }
 
   uint16_t set_alignment(Alignment allign) {
-    return write_bytes({0x1b, 0x61, static_cast<uint8_t>(allign)});
+    return write_bytes(cmd::align(static_cast<uint8_t>(allign)));
   }
 
   uint16_t set_underline(uint8_t thickness) {
-    if (thickness > 2)
-      thickness = 2;
-    return write_bytes({0x1b, 0x2d, thickness});
+    return write_bytes(cmd::underline(thickness));
+  }
+
+  // White on black (GS B). Applies to text; to raster images only where
+  // the device profile has raster_reverse.
+  uint16_t set_reverse(bool enabled) {
+    return write_bytes(cmd::reverse(enabled));
+  }
+
+  // Rotate characters 180 degrees (ESC {). Lines still come out in the
+  // order they are sent, so send them last line first to read the whole
+  // block upside down.
+  uint16_t set_upside_down(bool enabled) {
+    return write_bytes(cmd::upside_down(enabled));
+  }
+
+  // Rotate characters 90 degrees clockwise (ESC V)
+  uint16_t set_rotate_90(bool enabled) {
+    return write_bytes(cmd::rotate_90(enabled));
+  }
+
+  // 1D barcode drawn by the printer (GS k); a few dozen bytes on the wire
+  // instead of a raster of the bars
+  size_t print_barcode(Barcode type, const std::string &data,
+                       const BarcodeStyle &style = BarcodeStyle()) {
+    std::vector<uint8_t> command;
+    encode_barcode(type, data, style, command);
+    return write_bytes(command);
+  }
+
+  // QR code drawn by the printer (GS ( k)
+  size_t print_qr(const std::string &data, const QrStyle &style = QrStyle()) {
+    std::vector<uint8_t> command;
+    encode_qr(data, style, command);
+    return write_bytes(command);
+  }
+
+  // PDF417 symbol drawn by the printer (GS ( k)
+  size_t print_pdf417(const std::string &data,
+                      const Pdf417Style &style = Pdf417Style()) {
+    std::vector<uint8_t> command;
+    encode_pdf417(data, style, command);
+    return write_bytes(command);
   }
 
   uint16_t print_bitmap(BitmapMode mode, uint16_t width, uint16_t height,
                         const std::vector<uint8_t> &bitmap) {
-
-    uint8_t width_first = (width / 8) & 0x00ff;
-    uint8_t width_second = ((width / 8) >> 8) & 0x00ff;
-    uint8_t height_first = height & 0x00ff;
-    uint8_t height_second = (height >> 8) & 0x00ff;
-    std::vector<uint8_t> data{
-        0x1d,        0x76,         0x30,         static_cast<uint8_t>(mode),
-        width_first, width_second, height_first, height_second};
-    return write_bytes(data) + write_bytes(bitmap);
+    return write_bytes(cmd::raster_header(static_cast<uint8_t>(mode),
+                                          width / 8, height)) +
+           write_bytes(bitmap);
   }
 
   static inline constexpr uint8_t enable_ascii_9x17(uint8_t optbit) {
@@ -224,28 +663,315 @@ public:
   }
 
   void cleanup() {
-    if (dev_handle) {
-      libusb_release_interface(dev_handle, 0);
-      libusb_close(dev_handle);
-      dev_handle = nullptr;
+    transport = nullptr;
+    owned_transport.reset();
+  }
+
+private:
+  static size_t raster_bytes_per_line(uint16_t width, uint16_t lines_per_batch) {
+    if (width % 8 != 0) {
+      throw std::runtime_error("Width must be multiple of 8");
+    }
+    if (lines_per_batch == 0) {
+      throw std::runtime_error("Lines per batch must be positive");
+    }
+    return width / 8;
+  }
+
+  static bool is_blank_row(const uint8_t *row, size_t bytes_per_line) {
+    return count_black_dots(row, bytes_per_line) == 0;
+  }
+
+  // Number of consecutive blank rows starting at first
+  static uint32_t blank_rows(const uint8_t *bitmap, size_t bytes_per_line,
+                             uint32_t first, uint32_t height) {
+    uint32_t y = first;
+    while (y < height && is_blank_row(bitmap + y * bytes_per_line,
+                                      bytes_per_line))
+      ++y;
+    return y - first;
+  }
+
+  // Rows from first up to the start of the next long blank run
+  static uint16_t rows_before_blank_run(const uint8_t *bitmap,
+                                        size_t bytes_per_line, uint32_t first,
+                                        uint16_t count) {
+    uint16_t run = 0;
+    for (uint16_t i = 0; i < count; ++i) {
+      bool blank = is_blank_row(bitmap + (first + i) * bytes_per_line,
+                                bytes_per_line);
+      run = blank ? run + 1 : 0;
+      if (run == BLANK_RUN)
+        return i + 1 - run;
     }
+    return count;
+  }
 
-    if (ctx) {
-      libusb_exit(ctx);
-      ctx = nullptr;
+  // Dots of paper per source row; TALL and HUGE double vertically
+  static uint32_t row_height(BitmapMode mode) {
+    return mode == BitmapMode::TALL || mode == BitmapMode::HUGE ? 2 : 1;
+  }
+
+  size_t feed_blank_rows(uint32_t rows) {
+    size_t sent = 0;
+    while (rows > 0) {
+      uint8_t dots = static_cast<uint8_t>(std::min<uint32_t>(rows, 255));
+      if (pacing)
+        wait_for_head();
+      sent += feed_dots(dots);
+      if (pacing)
+        queue_burn_time(static_cast<uint64_t>(dots) * heat.line_us);
+      rows -= dots;
     }
+    return sent;
   }
 
-private:
-  static constexpr uint64_t USB_VENDOR = 10473;
-  static constexpr uint64_t USB_PRODUCT = 649;
+  // Rows that have to go out together: ESC * prints 24-dot bands, and a
+  // batch ending inside one would leave a short band mid-image
+  uint16_t band_rows(BitmapMode mode) const {
+    return raster_command == RasterCommand::ESC_STAR &&
+                   mode == BitmapMode::NORMAL
+               ? 24
+               : 1;
+  }
+
+  // Round a batch size down to whole bands, but to no less than one band
+  uint16_t whole_bands(BitmapMode mode, uint16_t rows) const {
+    uint16_t step = band_rows(mode);
+    return rows < step ? step : rows - rows % step;
+  }
+
+  // Send rows as GS v 0 blocks, split and timed by predicted burn time when
+  // pacing is enabled
+  size_t send_raster_segment(BitmapMode mode, size_t bytes_per_line,
+                             const uint8_t *rows, uint16_t count) {
+    if (!pacing)
+      return send_raster_block(mode, bytes_per_line, rows, count);
+
+    uint16_t step = band_rows(mode);
+    size_t max_rows = std::max<size_t>(
+        step, heat.buffer_bytes / 2 / bytes_per_line / step * step);
+    size_t sent = 0;
+    uint16_t done = 0;
+
+    while (done < count) {
+      uint64_t burn_us = 0;
+      uint16_t n = 0;
+      while (done + n < count && n < max_rows &&
+             (n == 0 || burn_us < heat.segment_us)) {
+        for (uint16_t i = 0; i < step && done + n < count; ++i) {
+          burn_us += heat.line_time_us(count_black_dots(
+              rows + (done + n) * bytes_per_line, bytes_per_line));
+          ++n;
+        }
+      }
+
+      wait_for_head();
+      sent += send_raster_block(mode, bytes_per_line,
+                                rows + done * bytes_per_line, n);
+      queue_burn_time(burn_us);
+      done += n;
+    }
+
+    return sent;
+  }
+
+  void attach(Transport &channel, bool probe) {
+    transport = &channel;
+    max_packet_size = channel.max_packet_size();
+
+    profile = DeviceProfile();
+    profile.manufacturer = channel.manufacturer();
+    profile.model = channel.product();
+    if (probe)
+      probe_device();
+    set_device_profile(profile);
+  }
+
+  // Ask the printer who it is. Printers that ignore GS I keep the defaults.
+  void probe_device() {
+    std::string id = query({0x1d, 0x49, 0x01});
+    if (id.size() != 1)
+      return;
+
+    profile.responds_to_gs_i = true;
+    profile.model_id = id[0];
+
+    std::string type = query({0x1d, 0x49, 0x02});
+    if (type.size() == 1)
+      profile.type_id = type[0];
+
+    // Extended replies are framed as '_' text NUL
+    std::string firmware = query({0x1d, 0x49, 0x41});
+    if (firmware.empty())
+      return;
+
+    profile.firmware = unframe(firmware);
+    std::string maker = unframe(query({0x1d, 0x49, 0x42}));
+    std::string model = unframe(query({0x1d, 0x49, 0x43}));
+    if (!maker.empty())
+      profile.manufacturer = maker;
+    if (!model.empty())
+      profile.model = model;
+
+    // Firmwares with extended GS I also implement the GS ( L graphics set
+    profile.raster_commands |= 1 << static_cast<int>(RasterCommand::GS_L);
+
+    std::string name = model;
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) {
+                     return static_cast<char>(std::toupper(c));
+                   });
+    if (name.find("80MM") != std::string::npos ||
+        name.find("576") != std::string::npos ||
+        name.compare(0, 4, "TM-T") == 0)
+      profile.print_width = 576;
+  }
+
+  // Send a request and collect the reply; empty if the printer stays silent
+  std::string query(const std::vector<uint8_t> &request) {
+    flush();
+    send_now(request.data(), request.size());
+
+    std::string reply;
+    uint8_t buffer[64];
+    size_t n;
+    while ((n = link().read(buffer, sizeof(buffer), PROBE_TIMEOUT)) > 0) {
+      reply.append(reinterpret_cast<char *>(buffer), n);
+      if (reply[0] != '_' || reply.back() == '\0')
+        break;
+    }
+    return reply;
+  }
+
+  static std::string unframe(const std::string &reply) {
+    if (reply.size() < 2 || reply[0] != '_')
+      return std::string();
+    size_t end = reply.find('\0');
+    return reply.substr(1, end == std::string::npos ? end : end - 1);
+  }
+
+  // Sleep until no more than lead_us of predicted printing is still queued
+  void wait_for_head() const {
+    if (holding)
+      return; // nothing reaches the printer until flush()
+    auto ready = busy_until - std::chrono::microseconds(heat.lead_us);
+    auto now = std::chrono::steady_clock::now();
+    if (ready > now)
+      usleep(std::chrono::duration_cast<std::chrono::microseconds>(ready - now)
+                 .count());
+  }
+
+  // Account for printing just handed to the printer
+  void queue_burn_time(uint64_t burn_us) {
+    if (holding)
+      return;
+    busy_until = std::max(busy_until, std::chrono::steady_clock::now()) +
+                 std::chrono::microseconds(burn_us);
+  }
+
+  // Send one block of at most 65535 rows with the selected raster command
+  size_t send_raster_block(BitmapMode mode, size_t bytes_per_line,
+                           const uint8_t *rows, uint16_t count) {
+    if (raster_command == RasterCommand::GS_V_0 || mode != BitmapMode::NORMAL)
+      return send_raster_header(mode, bytes_per_line, count) +
+             write_bytes(rows, bytes_per_line * count);
+
+    encode_buffer.clear();
+    encode_raster(raster_command, static_cast<uint8_t>(mode),
+                  ConstBitmap1View(rows,
+                                   static_cast<uint16_t>(bytes_per_line * 8),
+                                   count),
+                  encode_buffer);
+    return write_bytes(encode_buffer);
+  }
+
+  size_t send_raster_header(BitmapMode mode, size_t bytes_per_line,
+                            uint16_t count) {
+    return write_bytes(cmd::raster_header(
+        static_cast<uint8_t>(mode), static_cast<uint16_t>(bytes_per_line),
+        count));
+  }
+
+  size_t stream_chunk_bytes(size_t chunk_packets) const {
+    if (chunk_packets == 0) {
+      throw std::runtime_error("Chunk size must be positive");
+    }
+    return chunk_packets * max_packet_size;
+  }
+
+  // Stream raster payload in chunks of chunk_bytes without draining the IN
+  // endpoint in between. A trailing partial chunk is only sent when flush is
+  // set. Returns the number of bytes consumed.
+  size_t send_chunks(const uint8_t *data, size_t size, size_t bytes_per_line,
+                     size_t chunk_bytes, bool flush) {
+    if (holding) {
+      size_t n = flush ? size : size - size % chunk_bytes;
+      held.insert(held.end(), data, data + n);
+      return n;
+    }
+
+    size_t offset = 0;
+    while (size - offset >= chunk_bytes || (flush && offset < size)) {
+      size_t n = std::min(chunk_bytes, size - offset);
+
+      if (pacing)
+        wait_for_head();
+      transfer_out(data + offset, n);
+      if (pacing) {
+        // Chunks cut across rows, so use the chunk's average density
+        double rows = static_cast<double>(n) / bytes_per_line;
+        uint64_t dots = count_black_dots(data + offset, n);
+        queue_burn_time(static_cast<uint64_t>(
+            rows * heat.line_time_us(static_cast<uint64_t>(dots / rows))));
+      }
+
+      offset += n;
+    }
+    return offset;
+  }
+
+  // Drain pending replies from the IN endpoint, then send
+  size_t send_now(const uint8_t *data, size_t size) {
+    drain_replies();
+    return transfer_out(data, size);
+  }
+
+  void drain_replies() {
+    uint8_t buffer[64];
+    while (link().read(buffer, sizeof(buffer), 100) > 0) {
+    }
+  }
+
+  size_t transfer_out(const uint8_t *data, size_t size) {
+    return link().write(data, size);
+  }
+
+  Transport &link() {
+    if (!transport)
+      throw std::runtime_error("Printer is not open");
+    return *transport;
+  }
 
-  static constexpr uint64_t BULK_ENDPOINT_IN = 0x81;
-  static constexpr uint64_t BULK_ENDPOINT_OUT = 0x03;
   static constexpr uint64_t TIMEOUT = 30000;
+  static constexpr uint64_t PROBE_TIMEOUT = 300;
+  static constexpr uint16_t BLANK_RUN = 24;
+
+  std::unique_ptr<Transport> owned_transport;
+  Transport *transport = nullptr;
+  size_t max_packet_size = 64;
+  DeviceProfile profile;
+
+  RasterCommand raster_command = RasterCommand::GS_V_0;
+  std::vector<uint8_t> encode_buffer;
+
+  bool skip_blank_rows = false;
+  bool pacing = false;
+  HeatModel heat;
+  std::chrono::steady_clock::time_point busy_until;
 
-  libusb_context *ctx = nullptr;
-  libusb_device_handle *dev_handle = nullptr;
+  bool holding = false;
+  std::vector<uint8_t> held;
 };
 } // namespace em5820
 
@@ -0,0 +1,188 @@
+#ifndef EM5820_RASTER_HPP
+#define EM5820_RASTER_HPP
+
+#include "bitmap.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace em5820 {
+
+// ESC/POS commands that can carry a packed raster
+enum class RasterCommand { GS_V_0, ESC_STAR, GS_L };
+
+inline RasterCommand raster_command_from_name(const std::string &name) {
+  if (name == "gs-v0")
+    return RasterCommand::GS_V_0;
+  if (name == "esc-star")
+    return RasterCommand::ESC_STAR;
+  if (name == "gs-l")
+    return RasterCommand::GS_L;
+  throw std::runtime_error("Unknown raster command: " + name);
+}
+
+inline const char *raster_command_name(RasterCommand command) {
+  switch (command) {
+  case RasterCommand::ESC_STAR:
+    return "esc-star";
+  case RasterCommand::GS_L:
+    return "gs-l";
+  case RasterCommand::GS_V_0:
+  default:
+    return "gs-v0";
+  }
+}
+
+// Transpose an 8x8 bit matrix. Row i is byte i counted from the most
+// significant end, column 0 is the MSB of each byte. (Hacker's Delight 7-3)
+inline uint64_t transpose8x8(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// Append the packed rows of a view back to back
+inline void append_rows(ConstBitmap1View rows, std::vector<uint8_t> &out) {
+  if (rows.contiguous()) {
+    out.insert(out.end(), rows.data,
+               rows.data + rows.bytes_per_line() * rows.height);
+    return;
+  }
+  for (uint32_t y = 0; y < rows.height; ++y)
+    out.insert(out.end(), rows.row(y), rows.row(y) + rows.bytes_per_line());
+}
+
+// GS v 0: the raster is sent as is, behind an 8 byte header
+inline void encode_gs_v0(uint8_t mode, ConstBitmap1View rows,
+                         std::vector<uint8_t> &out) {
+  size_t bytes_per_line = rows.bytes_per_line();
+  if (rows.height > 0xffff)
+    throw std::runtime_error("GS v 0 block taller than 65535 rows");
+
+  const uint8_t header[8]{0x1d,
+                          0x76,
+                          0x30,
+                          mode,
+                          static_cast<uint8_t>(bytes_per_line & 0xff),
+                          static_cast<uint8_t>((bytes_per_line >> 8) & 0xff),
+                          static_cast<uint8_t>(rows.height & 0xff),
+                          static_cast<uint8_t>((rows.height >> 8) & 0xff)};
+  out.insert(out.end(), header, header + sizeof(header));
+  append_rows(rows, out);
+}
+
+// ESC * 33: 24-dot double-density bands in column format, three bytes per
+// column with the top row in the MSB. Line spacing is set to the band height
+// so bands abut, and restored to the default afterwards.
+inline void encode_esc_star(ConstBitmap1View rows, std::vector<uint8_t> &out) {
+  size_t bytes_per_line = rows.bytes_per_line();
+  size_t width = rows.width;
+  uint32_t count = rows.height;
+
+  for (uint32_t top = 0; top < count; top += 24) {
+    uint32_t band_rows = std::min<uint32_t>(24, count - top);
+
+    const uint8_t spacing[3]{0x1b, 0x33, static_cast<uint8_t>(band_rows)};
+    const uint8_t header[5]{0x1b, 0x2a, 33, static_cast<uint8_t>(width & 0xff),
+                            static_cast<uint8_t>((width >> 8) & 0xff)};
+    out.insert(out.end(), spacing, spacing + sizeof(spacing));
+    out.insert(out.end(), header, header + sizeof(header));
+
+    size_t data = out.size();
+    out.resize(data + width * 3);
+    uint8_t *columns = &out[data];
+
+    for (size_t bx = 0; bx < bytes_per_line; ++bx) {
+      for (int k = 0; k < 3; ++k) {
+        // Gather an 8x8 block, padding below the last row with white
+        uint64_t block = 0;
+        for (int r = 0; r < 8; ++r) {
+          uint32_t y = top + k * 8 + r;
+          uint8_t row = y < count ? rows.row(y)[bx] : 0;
+          block |= static_cast<uint64_t>(row) << (56 - 8 * r);
+        }
+
+        block = transpose8x8(block);
+        for (int c = 0; c < 8; ++c)
+          columns[(bx * 8 + c) * 3 + k] =
+              static_cast<uint8_t>(block >> (56 - 8 * c));
+      }
+    }
+
+    out.push_back(0x0a);
+  }
+
+  const uint8_t default_spacing[2]{0x1b, 0x32};
+  out.insert(out.end(), default_spacing,
+             default_spacing + sizeof(default_spacing));
+}
+
+// GS ( L / GS 8 L fn 112: store the raster as a graphic in the print
+// buffer, then print it with fn 50. GS 8 L takes over once the data no
+// longer fits the 16-bit parameter length.
+inline void encode_gs_l(ConstBitmap1View rows, std::vector<uint8_t> &out) {
+  size_t width = rows.width;
+  size_t data_size = rows.bytes_per_line() * rows.height;
+  size_t p = 10 + data_size;
+  if (rows.height > 0xffff)
+    throw std::runtime_error("GS ( L graphic taller than 65535 rows");
+
+  if (p <= 0xffff) {
+    const uint8_t prefix[5]{0x1d, 0x28, 0x4c, static_cast<uint8_t>(p & 0xff),
+                            static_cast<uint8_t>((p >> 8) & 0xff)};
+    out.insert(out.end(), prefix, prefix + sizeof(prefix));
+  } else {
+    const uint8_t prefix[7]{0x1d,
+                            0x38,
+                            0x4c,
+                            static_cast<uint8_t>(p & 0xff),
+                            static_cast<uint8_t>((p >> 8) & 0xff),
+                            static_cast<uint8_t>((p >> 16) & 0xff),
+                            static_cast<uint8_t>((p >> 24) & 0xff)};
+    out.insert(out.end(), prefix, prefix + sizeof(prefix));
+  }
+
+  const uint8_t params[10]{0x30,
+                           0x70,
+                           0x30,
+                           0x01,
+                           0x01,
+                           0x31,
+                           static_cast<uint8_t>(width & 0xff),
+                           static_cast<uint8_t>((width >> 8) & 0xff),
+                           static_cast<uint8_t>(rows.height & 0xff),
+                           static_cast<uint8_t>((rows.height >> 8) & 0xff)};
+  out.insert(out.end(), params, params + sizeof(params));
+  append_rows(rows, out);
+
+  const uint8_t print[7]{0x1d, 0x28, 0x4c, 0x02, 0x00, 0x30, 0x32};
+  out.insert(out.end(), print, print + sizeof(print));
+}
+
+// Encode rows with the given command; mode only applies to GS v 0
+inline void encode_raster(RasterCommand command, uint8_t mode,
+                          ConstBitmap1View rows, std::vector<uint8_t> &out) {
+  switch (command) {
+  case RasterCommand::ESC_STAR:
+    encode_esc_star(rows, out);
+    break;
+  case RasterCommand::GS_L:
+    encode_gs_l(rows, out);
+    break;
+  case RasterCommand::GS_V_0:
+  default:
+    encode_gs_v0(mode, rows, out);
+    break;
+  }
+}
+
+} // namespace em5820
+
+#endif // EM5820_RASTER_HPP
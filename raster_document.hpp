@@ -0,0 +1,143 @@
+#ifndef EM5820_RASTER_DOCUMENT_HPP
+#define EM5820_RASTER_DOCUMENT_HPP
+
+#include "printer.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace em5820 {
+
+// A receipt kept as a stack of raster bands. Every band carries a content
+// key describing everything its pixels depend on (text, style, logo id).
+// Bands whose key was rendered before come from the cache, so printing the
+// next receipt only re-rasterizes the lines that changed.
+class RasterDocument {
+public:
+  // Draws into a band that starts out white
+  using Renderer = std::function<void(Bitmap1View band)>;
+
+  // max_age counts renders; the bands of the current one always stay cached
+  explicit RasterDocument(uint16_t width, uint32_t max_age = 8)
+      : width(width), max_age(max_age) {
+    if (width % 8 != 0)
+      throw std::runtime_error("Width must be multiple of 8");
+    if (max_age == 0)
+      throw std::runtime_error("Cache age must be at least 1");
+  }
+
+  // Start the next receipt; the band cache is kept
+  void clear() { bands.clear(); }
+
+  void add_band(const std::string &key, uint16_t height, Renderer render) {
+    Band band;
+    band.key = key + '\0' + std::to_string(height);
+    band.height = height;
+    band.render = std::move(render);
+    bands.push_back(std::move(band));
+  }
+
+  uint16_t get_width() const { return width; }
+
+  uint32_t get_height() const {
+    uint32_t height = 0;
+    for (const Band &band : bands)
+      height += band.height;
+    return height;
+  }
+
+  // Rasterize the bands missing from the cache and drop entries unused for
+  // max_age renders. Returns the number of bands that were rendered.
+  size_t render() {
+    size_t rendered = 0;
+    ++generation;
+
+    for (Band &band : bands) {
+      auto it = cache.find(band.key);
+      if (it == cache.end()) {
+        Entry entry;
+        entry.bits = Bitmap1(width, band.height);
+        band.render(entry.bits.view());
+        it = cache.emplace(band.key, std::move(entry)).first;
+        ++rendered;
+      }
+      it->second.generation = generation;
+      band.bits = &it->second.bits;
+    }
+
+    for (auto it = cache.begin(); it != cache.end();) {
+      if (generation - it->second.generation >= max_age)
+        it = cache.erase(it);
+      else
+        ++it;
+    }
+
+    return rendered;
+  }
+
+  // Render, then print the bands straight from the cache
+  uint64_t print(Printer &printer, uint16_t lines_per_batch = 50) {
+    render();
+
+    size_t index = 0;
+    uint32_t band_top = 0;
+
+    return printer.print_bitmap_lines(
+        Printer::BitmapMode::NORMAL, width, get_height(),
+        [&](uint32_t first, uint16_t count, uint8_t *dst) {
+          while (count > 0) {
+            while (first >= band_top + bands[index].height)
+              band_top += bands[index++].height;
+
+            const Band &band = bands[index];
+            uint32_t offset = first - band_top;
+            uint16_t rows = static_cast<uint16_t>(
+                std::min<uint32_t>(count, band.height - offset));
+            copy(band.bits->view().rows(offset, rows),
+                 Bitmap1View(dst, width, rows));
+
+            dst += rows * (width / 8);
+            first += rows;
+            count -= rows;
+          }
+        },
+        lines_per_batch);
+  }
+
+  // Render and return the whole receipt as one packed bitmap
+  Bitmap1 bitmap() {
+    render();
+    Bitmap1 out(width, get_height());
+    uint32_t top = 0;
+    for (const Band &band : bands) {
+      copy(band.bits->view(), out.view().rows(top, band.height));
+      top += band.height;
+    }
+    return out;
+  }
+
+private:
+  struct Band {
+    std::string key;
+    uint16_t height = 0;
+    Renderer render;
+    const Bitmap1 *bits = nullptr;
+  };
+
+  struct Entry {
+    Bitmap1 bits;
+    uint32_t generation = 0;
+  };
+
+  uint16_t width;
+  uint32_t max_age;
+  uint32_t generation = 0;
+  std::vector<Band> bands;
+  std::unordered_map<std::string, Entry> cache;
+};
+
+} // namespace em5820
+
+#endif // EM5820_RASTER_DOCUMENT_HPP
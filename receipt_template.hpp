@@ -0,0 +1,369 @@
+#ifndef EM5820_RECEIPT_TEMPLATE_HPP
+#define EM5820_RECEIPT_TEMPLATE_HPP
+
+#include "printer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace em5820 {
+
+// Read one CSV record: comma separated, fields optionally in double quotes
+// with "" for a quote, quoted fields may span lines. Returns false at the
+// end of the input.
+inline bool read_csv_row(std::istream &in, std::vector<std::string> &row) {
+  row.clear();
+  int c = in.get();
+  if (c == EOF)
+    return false;
+
+  std::string field;
+  bool quoted = false;
+  for (; c != EOF; c = in.get()) {
+    if (quoted) {
+      if (c != '"')
+        field += static_cast<char>(c);
+      else if (in.peek() == '"')
+        field += static_cast<char>(in.get());
+      else
+        quoted = false;
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      row.push_back(field);
+      field.clear();
+    } else if (c == '\n') {
+      break;
+    } else if (c != '\r') {
+      field += static_cast<char>(c);
+    }
+  }
+  row.push_back(field);
+  return true;
+}
+
+// A receipt layout compiled once into the ESC/POS bytes it prints, plus a
+// patch table of where the field values go. Rendering copies the literal
+// spans and writes the values in between; nothing is parsed or formatted
+// per receipt. Each receipt starts left aligned in plain text.
+//
+// Layout source, one line per printed line:
+//   text with {field}, {field:12} (padded or cut to 12 columns, left
+//   aligned) or {field:>12} (right aligned); {{ and }} print braces
+//   @left @center @right          alignment
+//   @bold @underline @wide @tall @large @normal   text style (@normal
+//                                  clears the others)
+//   @feed N                        feed N lines
+//   @logo NAME                     a bitmap passed to compile()
+//   @qr TEXT                       QR code; TEXT may be or hold fields
+//   @barcode TYPE TEXT             1D barcode (see barcode_from_name)
+//   @@...                          a text line starting with @
+class ReceiptTemplate {
+public:
+  using Logos = std::map<std::string, ConstBitmap1View>;
+
+  static ReceiptTemplate compile(const std::string &source,
+                                 const Logos &logos = Logos()) {
+    ReceiptTemplate t;
+    std::istringstream lines(source);
+    std::string line;
+    uint8_t style = 0;
+
+    // Start from left-aligned plain text, whatever the receipt before it
+    // left set, so every receipt of a merge prints as it does alone
+    t.add_literal(cmd::align(0));
+    t.add_literal(cmd::print_mode(0));
+
+    while (std::getline(lines, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+      if (line.empty() || line[0] != '@' || line.compare(0, 2, "@@") == 0) {
+        t.add_text(line.empty() || line[0] != '@' ? line : line.substr(1));
+        t.add_literal("\n");
+        continue;
+      }
+
+      std::istringstream words(line.substr(1));
+      std::string directive, rest;
+      words >> directive;
+      std::getline(words >> std::ws, rest);
+
+      if (directive == "left" || directive == "center" ||
+          directive == "right") {
+        uint8_t n = directive == "left" ? 0 : directive == "center" ? 1 : 2;
+        t.add_literal(cmd::align(n));
+      } else if (directive == "bold" || directive == "underline" ||
+                 directive == "wide" || directive == "tall" ||
+                 directive == "large" || directive == "normal") {
+        if (directive == "bold")
+          style = Printer::enable_bold(style);
+        else if (directive == "underline")
+          style = Printer::enable_underline(style);
+        else if (directive == "wide")
+          style = Printer::enable_double_wide(style);
+        else if (directive == "tall")
+          style = Printer::enable_double_height(style);
+        else if (directive == "large")
+          style = Printer::enable_double_wide(
+              Printer::enable_double_height(style));
+        else
+          style = 0;
+        t.add_literal(cmd::print_mode(style));
+      } else if (directive == "feed") {
+        t.add_literal(
+            cmd::feed_lines(static_cast<uint8_t>(std::stoi(rest))));
+      } else if (directive == "logo") {
+        auto it = logos.find(rest);
+        if (it == logos.end())
+          throw std::runtime_error("Unknown logo: " + rest);
+        encode_gs_v0(0, it->second, t.bytes);
+      } else if (directive == "qr") {
+        t.add_code(Patch::QR, Barcode::CODE128, rest);
+      } else if (directive == "barcode") {
+        std::istringstream args(rest);
+        std::string type, data;
+        args >> type;
+        std::getline(args >> std::ws, data);
+        t.add_code(Patch::BARCODE, barcode_from_name(type), data);
+      } else {
+        throw std::runtime_error("Unknown template directive: @" + directive);
+      }
+    }
+
+    return t;
+  }
+
+  // Field names in the order render() expects their values
+  const std::vector<std::string> &get_fields() const { return fields; }
+
+  // Compiled bytes with fixed-width slots blank, codes and variable fields
+  // left out
+  const std::vector<uint8_t> &get_bytes() const { return bytes; }
+
+  void render(const std::vector<std::string> &values,
+              std::vector<uint8_t> &out) const {
+    if (values.size() < fields.size())
+      throw std::runtime_error("Missing template field values");
+
+    out.clear();
+    out.reserve(bytes.size() + 16 * patches.size());
+    size_t pos = 0;
+
+    for (const Patch &patch : patches) {
+      out.insert(out.end(), bytes.begin() + pos, bytes.begin() + patch.offset);
+      pos = patch.offset;
+
+      switch (patch.kind) {
+      case Patch::TEXT:
+        append_text(values[patch.field], patch, out);
+        pos += patch.width;
+        break;
+      case Patch::QR:
+        encode_qr(expand(patch, values), QrStyle(), out);
+        break;
+      case Patch::BARCODE:
+        encode_barcode(patch.barcode, expand(patch, values), BarcodeStyle(),
+                       out);
+        break;
+      }
+    }
+
+    out.insert(out.end(), bytes.begin() + pos, bytes.end());
+  }
+
+  std::vector<uint8_t> render(const std::vector<std::string> &values) const {
+    std::vector<uint8_t> out;
+    render(values, out);
+    return out;
+  }
+
+  std::vector<uint8_t>
+  render(const std::map<std::string, std::string> &values) const {
+    std::vector<std::string> ordered;
+    for (const std::string &name : fields) {
+      auto it = values.find(name);
+      if (it == values.end())
+        throw std::runtime_error("Missing template field: " + name);
+      ordered.push_back(it->second);
+    }
+    return render(ordered);
+  }
+
+  // Mail merge: the first CSV row names the columns, every further row is
+  // rendered into one reused buffer and handed to emit. Returns the number
+  // of receipts rendered.
+  size_t
+  merge_csv(std::istream &csv,
+            const std::function<void(const std::vector<uint8_t> &)> &emit)
+      const {
+    std::vector<std::string> row;
+    if (!read_csv_row(csv, row))
+      return 0;
+
+    std::vector<size_t> column(fields.size());
+    for (size_t f = 0; f < fields.size(); ++f) {
+      size_t c = 0;
+      while (c < row.size() && row[c] != fields[f])
+        ++c;
+      if (c == row.size())
+        throw std::runtime_error("CSV has no column for field: " + fields[f]);
+      column[f] = c;
+    }
+
+    std::vector<std::string> values(fields.size());
+    std::vector<uint8_t> out;
+    size_t count = 0;
+
+    while (read_csv_row(csv, row)) {
+      if (row.size() == 1 && row[0].empty())
+        continue;
+      for (size_t f = 0; f < fields.size(); ++f)
+        values[f] = column[f] < row.size() ? row[column[f]] : std::string();
+      render(values, out);
+      emit(out);
+      ++count;
+    }
+
+    return count;
+  }
+
+private:
+  struct Patch {
+    enum Kind { TEXT, QR, BARCODE };
+    Kind kind = TEXT;
+    size_t offset = 0; // into bytes
+    size_t field = 0;  // TEXT: the value; codes: unused
+    size_t width = 0;  // TEXT: slot columns, 0 = as long as the value
+    bool right = false;
+    Barcode barcode = Barcode::CODE128;
+    // Codes: literal pieces around fields, alternating text, field index
+    std::vector<std::string> pieces;
+    std::vector<size_t> piece_fields;
+  };
+
+  std::vector<uint8_t> bytes;
+  std::vector<Patch> patches;
+  std::vector<std::string> fields;
+
+  void add_literal(const std::string &text) {
+    bytes.insert(bytes.end(), text.begin(), text.end());
+  }
+
+  template <size_t N> void add_literal(const Command<N> &command) {
+    bytes.insert(bytes.end(), command.data(), command.data() + N);
+  }
+
+  size_t field_index(const std::string &name) {
+    for (size_t i = 0; i < fields.size(); ++i)
+      if (fields[i] == name)
+        return i;
+    fields.push_back(name);
+    return fields.size() - 1;
+  }
+
+  // Split text into literal pieces and {field[:[>]width]} references.
+  // on_field gets the name and the spec after the colon.
+  template <typename Literal, typename Field>
+  static void scan(const std::string &text, Literal on_literal,
+                   Field on_field) {
+    std::string literal;
+    for (size_t i = 0; i < text.size(); ++i) {
+      char c = text[i];
+      if ((c == '{' || c == '}') && i + 1 < text.size() && text[i + 1] == c) {
+        literal += c;
+        ++i;
+      } else if (c == '{') {
+        size_t end = text.find('}', i);
+        if (end == std::string::npos)
+          throw std::runtime_error("Unterminated field in: " + text);
+        std::string ref = text.substr(i + 1, end - i - 1);
+        size_t colon = ref.find(':');
+        on_literal(literal);
+        literal.clear();
+        on_field(ref.substr(0, colon),
+                 colon == std::string::npos ? "" : ref.substr(colon + 1));
+        i = end;
+      } else {
+        literal += c;
+      }
+    }
+    on_literal(literal);
+  }
+
+  void add_text(const std::string &text) {
+    scan(
+        text, [&](const std::string &literal) { add_literal(literal); },
+        [&](const std::string &name, const std::string &spec) {
+          Patch patch;
+          patch.offset = bytes.size();
+          patch.field = field_index(name);
+          patch.right = !spec.empty() && spec[0] == '>';
+          if (!spec.empty())
+            patch.width = std::stoul(spec.substr(patch.right ? 1 : 0));
+          // Reserve the slot so the line keeps its length
+          bytes.insert(bytes.end(), patch.width, ' ');
+          patches.push_back(patch);
+        });
+  }
+
+  void add_code(Patch::Kind kind, Barcode type, const std::string &text) {
+    Patch patch;
+    patch.kind = kind;
+    patch.offset = bytes.size();
+    patch.barcode = type;
+    patch.pieces.emplace_back();
+    scan(
+        text,
+        [&](const std::string &literal) { patch.pieces.back() += literal; },
+        [&](const std::string &name, const std::string &) {
+          patch.piece_fields.push_back(field_index(name));
+          patch.pieces.emplace_back();
+        });
+
+    if (patch.piece_fields.empty()) {
+      // Nothing to fill in: encode it now
+      if (kind == Patch::QR)
+        encode_qr(patch.pieces[0], QrStyle(), bytes);
+      else
+        encode_barcode(type, patch.pieces[0], BarcodeStyle(), bytes);
+      return;
+    }
+    patches.push_back(patch);
+  }
+
+  // Field values are printed as text; control bytes would be taken as
+  // commands, so they become spaces
+  static void append_text(const std::string &value, const Patch &patch,
+                          std::vector<uint8_t> &out) {
+    size_t length = patch.width ? std::min(value.size(), patch.width)
+                                : value.size();
+    size_t pad = patch.width - (patch.width ? length : 0);
+    if (patch.right)
+      out.insert(out.end(), pad, ' ');
+    for (size_t i = 0; i < length; ++i) {
+      uint8_t c = static_cast<uint8_t>(value[i]);
+      out.push_back(c < 0x20 || c == 0x7f ? ' ' : c);
+    }
+    if (!patch.right)
+      out.insert(out.end(), pad, ' ');
+  }
+
+  static std::string expand(const Patch &patch,
+                            const std::vector<std::string> &values) {
+    std::string data = patch.pieces[0];
+    for (size_t i = 0; i < patch.piece_fields.size(); ++i)
+      data += values[patch.piece_fields[i]] + patch.pieces[i + 1];
+    return data;
+  }
+};
+
+} // namespace em5820
+
+#endif // EM5820_RECEIPT_TEMPLATE_HPP
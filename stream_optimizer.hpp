@@ -0,0 +1,181 @@
+#ifndef EM5820_STREAM_OPTIMIZER_HPP
+#define EM5820_STREAM_OPTIMIZER_HPP
+
+#include "escpos_parser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace em5820 {
+
+// What optimize_stream() did
+struct StreamStats {
+  size_t dropped_commands = 0; // state changes that changed nothing
+  size_t merged_feeds = 0;     // feeds folded into the one before
+  size_t joined_rasters = 0;   // GS v 0 blocks appended to the one before
+};
+
+// Rewrite an encoded command stream into one that prints the same, with
+//   - alignment, print mode, character size and underline commands that
+//     set what is already set dropped (alignment only at the start of a
+//     line, where it takes effect; mid-line it is kept),
+//   - ESC @ dropped when nothing has changed since the last one,
+//   - ESC $ followed directly by another ESC $ dropped,
+//   - adjacent ESC J and ESC d feeds merged,
+//   - adjacent GS v 0 blocks of the same mode and width joined.
+// State is unknown until the first ESC @. Commands the optimizer does not
+// model are copied and make it assume the printer state changed; from an
+// undecodable byte on, the stream is copied as is.
+inline StreamStats optimize_stream(const uint8_t *data, size_t size,
+                                   std::vector<uint8_t> &out) {
+  const int UNKNOWN = -1;
+  int alignment = UNKNOWN, mode = UNKNOWN, scale = UNKNOWN,
+      underline = UNKNOWN;
+  bool changed = true;       // state not modelled here may differ from reset
+  bool line_pending = false; // text waiting in the line buffer
+
+  // The command that currently ends out, for merging into
+  enum { NONE, POSITION, FEED_DOTS, FEED_LINES, RASTER } last = NONE;
+  size_t last_offset = 0;
+
+  StreamStats stats;
+  out.clear();
+  out.reserve(size);
+
+  size_t used = parse_escpos(data, size, [&](const EscPosCommand &command) {
+    const uint8_t *p = command.bytes;
+    auto copy = [&] { out.insert(out.end(), p, p + command.size); };
+    auto keep = [&](int &state, int value) {
+      if (state == value) {
+        ++stats.dropped_commands;
+        return;
+      }
+      state = value;
+      last = NONE;
+      copy();
+    };
+
+    switch (command.type) {
+    case CommandType::TEXT:
+      line_pending = true;
+      last = NONE;
+      copy();
+      break;
+    case CommandType::LINE_FEED:
+      line_pending = false;
+      last = NONE;
+      copy();
+      break;
+    case CommandType::RESET:
+      if (!changed && !line_pending && alignment == 0 && mode == 0 &&
+          scale == 0 && underline == 0) {
+        ++stats.dropped_commands;
+        break;
+      }
+      alignment = mode = scale = underline = 0;
+      changed = line_pending = false;
+      last = NONE;
+      copy();
+      break;
+    case CommandType::ALIGN:
+      // Only takes effect at the start of a line; mid-line the printer may
+      // ignore it, so what is set becomes unknown
+      if (line_pending) {
+        alignment = UNKNOWN;
+        last = NONE;
+        copy();
+        break;
+      }
+      keep(alignment, command.arg % 48);
+      break;
+    case CommandType::PRINT_MODE:
+      // Its underline and double-size bits overlap ESC - and GS !
+      if (static_cast<int>(command.arg) != mode)
+        scale = underline = UNKNOWN;
+      keep(mode, command.arg);
+      break;
+    case CommandType::TEXT_SIZE:
+      if (static_cast<int>(command.arg) != scale)
+        mode = UNKNOWN;
+      keep(scale, command.arg);
+      break;
+    case CommandType::UNDERLINE:
+      if (static_cast<int>(command.arg % 48) != underline)
+        mode = UNKNOWN;
+      keep(underline, command.arg % 48);
+      break;
+    case CommandType::POSITION:
+      // Moves the print position in the line buffer, which ESC @ resets
+      line_pending = true;
+      if (last == POSITION) {
+        out[last_offset + 2] = p[2];
+        out[last_offset + 3] = p[3];
+        ++stats.dropped_commands;
+        break;
+      }
+      last = POSITION;
+      last_offset = out.size();
+      copy();
+      break;
+    case CommandType::FEED_DOTS:
+    case CommandType::FEED_LINES: {
+      // Both print the line buffer first, so a + b feeds the same as one
+      auto kind = command.type == CommandType::FEED_DOTS ? FEED_DOTS
+                                                         : FEED_LINES;
+      line_pending = false;
+      if (last == kind && out[last_offset + 2] + command.arg <= 0xff) {
+        out[last_offset + 2] += static_cast<uint8_t>(command.arg);
+        ++stats.merged_feeds;
+        break;
+      }
+      last = kind;
+      last_offset = out.size();
+      copy();
+      break;
+    }
+    case CommandType::RASTER:
+      if (last == RASTER && out[last_offset + 3] == command.arg &&
+          (out[last_offset + 4] | out[last_offset + 5] << 8) ==
+              static_cast<int>(command.width)) {
+        uint8_t *header = &out[last_offset];
+        size_t total = (header[6] | header[7] << 8) + command.height;
+        if (total <= 0xffff) {
+          header[6] = static_cast<uint8_t>(total & 0xff);
+          header[7] = static_cast<uint8_t>(total >> 8);
+          out.insert(out.end(), command.payload,
+                     command.payload + command.payload_size);
+          ++stats.joined_rasters;
+          break;
+        }
+      }
+      last = RASTER;
+      last_offset = out.size();
+      copy();
+      break;
+    default:
+      if (command.type == CommandType::BOLD)
+        mode = UNKNOWN;
+      changed = true;
+      last = NONE;
+      copy();
+      break;
+    }
+  });
+
+  // A command cut off at the end goes out as it came
+  out.insert(out.end(), data + used, data + size);
+  return stats;
+}
+
+inline std::vector<uint8_t> optimize_stream(const std::vector<uint8_t> &in,
+                                            StreamStats *stats = nullptr) {
+  std::vector<uint8_t> out;
+  StreamStats s = optimize_stream(in.data(), in.size(), out);
+  if (stats)
+    *stats = s;
+  return out;
+}
+
+} // namespace em5820
+
+#endif // EM5820_STREAM_OPTIMIZER_HPP
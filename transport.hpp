@@ -0,0 +1,168 @@
+#ifndef EM5820_TRANSPORT_HPP
+#define EM5820_TRANSPORT_HPP
+
+#include <libusb-1.0/libusb.h>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace em5820 {
+
+// The link a Printer talks through: commands go out, status replies come
+// back. USB to a real printer by default; an Emulator or a recorder can
+// stand in for it.
+class Transport {
+public:
+  virtual ~Transport() {}
+
+  // Send all of data; throws if the link fails
+  virtual size_t write(const uint8_t *data, size_t size) = 0;
+
+  // Read pending reply bytes, waiting up to timeout_ms for the first ones.
+  // Returns 0 when nothing came.
+  virtual size_t read(uint8_t *buffer, size_t size, unsigned timeout_ms) = 0;
+
+  // Largest single packet, the unit of chunked streaming
+  virtual size_t max_packet_size() const { return 64; }
+
+  // Identity before any command is sent, like the USB string descriptors
+  virtual std::string manufacturer() { return std::string(); }
+  virtual std::string product() { return std::string(); }
+};
+
+// Bulk endpoints of the EM5820 over libusb
+class UsbTransport : public Transport {
+public:
+  static constexpr uint16_t USB_VENDOR = 10473;
+  static constexpr uint16_t USB_PRODUCT = 649;
+
+  explicit UsbTransport(uint16_t vendor = USB_VENDOR,
+                        uint16_t product_id = USB_PRODUCT) {
+    if (libusb_init(&ctx) < 0) {
+      ctx = nullptr;
+      throw std::runtime_error("Failed to initialize libusb");
+    }
+
+    libusb_device **dev_list = nullptr;
+    ssize_t count = libusb_get_device_list(ctx, &dev_list);
+    if (count < 0) {
+      close();
+      throw std::runtime_error("Failed to get USB device list");
+    }
+
+    libusb_device *target_device = nullptr;
+    for (ssize_t i = 0; i < count; ++i) {
+      libusb_device *device = dev_list[i];
+      libusb_get_device_descriptor(device, &desc);
+      if (desc.idVendor == vendor && desc.idProduct == product_id) {
+        target_device = device;
+        break;
+      }
+    }
+
+    if (!target_device) {
+      libusb_free_device_list(dev_list, 1);
+      close();
+      throw std::runtime_error("Target USB device not found");
+    }
+
+    if (libusb_open(target_device, &dev_handle) < 0) {
+      dev_handle = nullptr;
+      libusb_free_device_list(dev_list, 1);
+      close();
+      throw std::runtime_error("Failed to open USB device");
+    }
+
+    libusb_free_device_list(dev_list, 1);
+
+    if (libusb_kernel_driver_active(dev_handle, 0)) {
+      int ret = libusb_detach_kernel_driver(dev_handle, 0);
+      if (ret != 0) {
+        close();
+        throw std::runtime_error("Failed to detach kernel driver: " +
+                                 std::string(libusb_error_name(ret)));
+      }
+    }
+
+    int ret = libusb_claim_interface(dev_handle, 0);
+    if (ret < 0) {
+      libusb_close(dev_handle);
+      dev_handle = nullptr;
+      close();
+      throw std::runtime_error("Failed to claim interface: " +
+                               std::string(libusb_error_name(ret)));
+    }
+
+    int size = libusb_get_max_packet_size(libusb_get_device(dev_handle),
+                                          BULK_ENDPOINT_OUT);
+    if (size > 0)
+      packet_size = size;
+  }
+
+  UsbTransport(const UsbTransport &) = delete;
+  UsbTransport &operator=(const UsbTransport &) = delete;
+
+  ~UsbTransport() override { close(); }
+
+  size_t write(const uint8_t *data, size_t size) override {
+    int transferred;
+    int ret = libusb_bulk_transfer(dev_handle, BULK_ENDPOINT_OUT,
+                                   const_cast<unsigned char *>(data), size,
+                                   &transferred, TIMEOUT);
+    if (ret != 0 || static_cast<size_t>(transferred) != size)
+      throw std::runtime_error("Failed transfer data: " +
+                               std::string(libusb_error_name(ret)));
+
+    return transferred;
+  }
+
+  size_t read(uint8_t *buffer, size_t size, unsigned timeout_ms) override {
+    int transferred = 0;
+    int ret = libusb_bulk_transfer(dev_handle, BULK_ENDPOINT_IN, buffer, size,
+                                   &transferred, timeout_ms);
+    return ret == 0 ? transferred : 0;
+  }
+
+  size_t max_packet_size() const override { return packet_size; }
+
+  std::string manufacturer() override { return usb_string(desc.iManufacturer); }
+  std::string product() override { return usb_string(desc.iProduct); }
+
+private:
+  static constexpr uint8_t BULK_ENDPOINT_IN = 0x81;
+  static constexpr uint8_t BULK_ENDPOINT_OUT = 0x03;
+  static constexpr unsigned TIMEOUT = 30000;
+
+  libusb_context *ctx = nullptr;
+  libusb_device_handle *dev_handle = nullptr;
+  libusb_device_descriptor desc = libusb_device_descriptor();
+  size_t packet_size = 64;
+
+  void close() {
+    if (dev_handle) {
+      libusb_release_interface(dev_handle, 0);
+      libusb_close(dev_handle);
+      dev_handle = nullptr;
+    }
+
+    if (ctx) {
+      libusb_exit(ctx);
+      ctx = nullptr;
+    }
+  }
+
+  std::string usb_string(uint8_t index) {
+    unsigned char buffer[128];
+    if (index == 0)
+      return std::string();
+    int len = libusb_get_string_descriptor_ascii(dev_handle, index, buffer,
+                                                 sizeof(buffer));
+    return len > 0 ? std::string(reinterpret_cast<char *>(buffer), len)
+                   : std::string();
+  }
+};
+
+} // namespace em5820
+
+#endif // EM5820_TRANSPORT_HPP